@@ -0,0 +1,91 @@
+#ifndef __CY_BATCH_SCHEDULER__
+#define __CY_BATCH_SCHEDULER__
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+namespace cy {
+namespace sched {
+
+    enum class Mode_t : uint8_t { INLINE = 0, SHARD = 1, QUERY = 2 };
+    static const char* MODE_NAMES[3] = { "inline", "shard", "query" };
+
+    // What the cost model needs to know about a batch
+    struct BatchShape_t {
+        size_t UpdateBytes;
+        size_t QueryBytes;    // of the queries that are not answered by the result cache
+        size_t MaxQueryBytes;
+        size_t Segments;      // runs of queries between updates
+
+        BatchShape_t() : UpdateBytes(0), QueryBytes(0), MaxQueryBytes(0), Segments(0) {}
+    };
+
+    constexpr size_t HIT_DENSITY_CLASSES = 64; // documents of [2^k, 2^(k+1)) bytes share class k
+    constexpr double HIT_DENSITY_ALPHA = 0.5;
+
+    // Recent results per document byte, per length class of the documents and overall (for the
+    // classes not seen yet). The results of a query are what its walks found before dedup, so they
+    // follow its cost. The class is a stable key: unlike a bucket of document hashes it is not
+    // shared by unrelated documents at random, and it needs no hash of the document.
+    struct HitDensity_t {
+        double Overall;
+        std::vector<double> Class; // negative if no document of the class was seen yet
+
+        HitDensity_t() : Overall(0), Class(HIT_DENSITY_CLASSES, -1.0) {}
+
+        static inline size_t _class(const size_t docBytes) { return 63 - __builtin_clzll(docBytes); }
+
+        inline void Observe(const size_t docBytes, const size_t hits) {
+            if (!docBytes) { return; }
+            const double density = double(hits) / docBytes;
+            Overall = HIT_DENSITY_ALPHA * density + (1-HIT_DENSITY_ALPHA) * Overall;
+            auto& c = Class[_class(docBytes)];
+            c = c < 0 ? density : HIT_DENSITY_ALPHA * density + (1-HIT_DENSITY_ALPHA) * c;
+        }
+
+        // Every byte is walked, and every hit adds a result to sort and format
+        inline double Cost(const size_t docBytes) const {
+            if (!docBytes) { return 0; }
+            const double c = Class[_class(docBytes)];
+            return docBytes * (1.0 + (c < 0 ? Overall : c));
+        }
+    };
+
+    // Picks how each batch is executed from its estimated cost:
+    //  INLINE - the master alone, without entering a parallel region
+    //  SHARD  - every thread does the updates and the query words of its own shard
+    //  QUERY  - the threads share the queries between updates, each one against all the shards
+    // The costs are calibrated at startup (see calibrateScheduler in main.cpp).
+    struct Scheduler_t {
+        size_t NumThreads;
+        double RegionUs;  // entering and leaving a parallel region
+        double BarrierUs;
+        double ByteUs;    // processing one byte of an update or a query against all the shards
+        size_t Batches[3];
+
+        Scheduler_t(const size_t nthreads) : NumThreads(nthreads), RegionUs(0), BarrierUs(0), ByteUs(0), Batches{0,0,0} {}
+
+        // @param shardSkew The load of the busiest shard over the mean load
+        Mode_t Choose(const BatchShape_t& b, const double shardSkew) const {
+            if (NumThreads == 1) { return Mode_t::INLINE; }
+
+            const double nth = NumThreads;
+            const double work = (b.UpdateBytes + b.QueryBytes) * ByteUs;
+            const double inlineUs = work;
+            const double shardUs = RegionUs + work * shardSkew / nth;
+            // a segment needs a barrier after its updates and one after its queries
+            const double queryUs = RegionUs + b.Segments * 2 * BarrierUs + b.UpdateBytes * ByteUs * shardSkew / nth
+                + std::max(b.QueryBytes / nth, (double)b.MaxQueryBytes) * ByteUs;
+
+            if (inlineUs <= shardUs && inlineUs <= queryUs) { return Mode_t::INLINE; }
+            return queryUs < shardUs ? Mode_t::QUERY : Mode_t::SHARD;
+        }
+    };
+
+};
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef __CY_BATCH_WRITER__
+#define __CY_BATCH_WRITER__
+
+#pragma once
+
+#include "ShmRing.hpp"
+
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+namespace cy {
+namespace io {
+
+    // Collects the output lines of a batch, one slot per query in query order, and writes
+    // them out with a single writev() when the batch is done (or copies them to the response
+    // ring of the shared memory transport).
+    // Each slot is only written by one thread so the lines can be formatted in parallel.
+    // The slot strings keep their capacity across batches and every slot gets room for
+    // the longest line so far, so formatting a line only allocates for a new longest line.
+    struct BatchWriter_t {
+        struct Slot_t {
+            std::string Line;
+            const std::string *Ext; // a line owned by somebody else (e.g. the result cache)
+
+            Slot_t() : Ext(nullptr) {}
+        };
+
+        int Fd;
+        ShmChannel_t *Shm; // instead of Fd when set
+        size_t NumSlots;
+        size_t LongestLine; // the longest line written so far
+        std::vector<Slot_t> Slots;
+        std::vector<struct iovec> Iov;
+
+        BatchWriter_t(const int fd = STDOUT_FILENO) : Fd(fd), Shm(nullptr), NumSlots(0), LongestLine(0) {}
+
+        inline void Reset(const size_t numOfQs) {
+            if (Slots.size() < numOfQs) { Slots.resize(numOfQs); }
+            NumSlots = numOfQs;
+            for (size_t i=0; i<numOfQs; ++i) {
+                Slots[i].Ext = nullptr;
+                Slots[i].Line.reserve(LongestLine);
+            }
+        }
+
+        inline std::string& Line(const size_t qidx) { return Slots[qidx].Line; }
+        inline void SetExternal(const size_t qidx, const std::string *line) { Slots[qidx].Ext = line; }
+
+        void Flush() {
+            if (Shm) {
+                for (size_t i=0; i<NumSlots; ++i) {
+                    const std::string& l = Slots[i].Ext ? *Slots[i].Ext : Slots[i].Line;
+                    Shm->Write(l.data(), l.size());
+                    LongestLine = std::max(LongestLine, l.size());
+                }
+                Shm->Flush();
+                NumSlots = 0;
+                return;
+            }
+
+            Iov.resize(NumSlots);
+            for (size_t i=0; i<NumSlots; ++i) {
+                const std::string& l = Slots[i].Ext ? *Slots[i].Ext : Slots[i].Line;
+                Iov[i].iov_base = const_cast<char*>(l.data());
+                Iov[i].iov_len = l.size();
+                LongestLine = std::max(LongestLine, l.size());
+            }
+
+            // Usually a single call unless the batch has more than IOV_MAX queries or the pipe is full
+            struct iovec *iov = Iov.data();
+            size_t iovcnt = NumSlots;
+            while (iovcnt) {
+                const ssize_t written = writev(Fd, iov, std::min<size_t>(iovcnt, IOV_MAX));
+                if (written < 0) {
+                    if (errno == EINTR) { continue; }
+                    perror("writev");
+                    abort();
+                }
+                size_t remaining = written;
+                while (iovcnt && remaining >= iov->iov_len) {
+                    remaining -= iov->iov_len;
+                    ++iov; --iovcnt;
+                }
+                if (remaining) {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+            NumSlots = 0;
+        }
+    };
+
+};
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __CY_CPU_DISPATCH__
+#define __CY_CPU_DISPATCH__
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace cy {
+namespace cpu {
+
+    // The instruction set levels the hot kernels have a variant for, in increasing order.
+    // The binary is built for the x86-64 baseline (SSE2) and each kernel picks its best variant
+    // not above the level of the CPU it runs on.
+    enum class Level_t : uint8_t { SSE2 = 0, SSE42 = 1, AVX2 = 2, AVX512BW = 3 };
+    static const char* LEVEL_NAMES[] = { "sse2", "sse4.2", "avx2", "avx512bw" };
+
+    // The level of this CPU, lowered to the one named by the CY_CPU environment variable if
+    // that is lower (to run the other variants on the same machine)
+    static inline Level_t _detectLevel() {
+        __builtin_cpu_init();
+        Level_t level = Level_t::SSE2;
+        if (__builtin_cpu_supports("sse4.2")) { level = Level_t::SSE42; }
+        if (__builtin_cpu_supports("avx2")) { level = Level_t::AVX2; }
+        if (__builtin_cpu_supports("avx512bw")) { level = Level_t::AVX512BW; }
+
+        const char *forced = std::getenv("CY_CPU");
+        if (forced) {
+            for (uint8_t l = 0; l < (uint8_t)level; ++l) {
+                if (std::strcmp(forced, LEVEL_NAMES[l]) == 0) { return (Level_t)l; }
+            }
+        }
+        return level;
+    }
+
+    static const Level_t LEVEL = _detectLevel();
+
+    inline bool Has(const Level_t l) { return LEVEL >= l; }
+
+};
+};
+
+#endif
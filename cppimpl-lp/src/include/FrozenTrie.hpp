@@ -0,0 +1,176 @@
+#ifndef __CY_FROZEN_TRIE__
+#define __CY_FROZEN_TRIE__
+
+#pragma once
+
+#include "CYUtils.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace cy {
+namespace frozen {
+
+    constexpr uint32_t NOT_FOUND = ~(uint32_t)0;
+    constexpr size_t LINEAR_SEARCH_MAX = 16;
+
+    // A read-only path compressed trie in flat arrays without pointers.
+    // The nodes are in breadth first order so the children of a node are contiguous and sorted
+    // by their first byte, which is kept in Keys (parallel to Nodes) for a compact child search.
+    // The rest of the edge into a node is its label in Labels. Node 0 is the root.
+    struct FrozenTrie_t {
+        struct Node_t {
+            uint32_t FirstChild;
+            uint32_t LabelOff;
+            uint32_t LabelLen;
+            uint16_t NumChildren;
+            uint8_t Valid;
+            uint8_t Pad;
+        };
+
+        std::vector<Node_t> Nodes;
+        std::vector<uint8_t> Keys;
+        std::vector<char> Labels;
+        size_t NumNgrams;
+
+        FrozenTrie_t() : NumNgrams(0) { Clear(); }
+
+        void Clear() {
+            Nodes.assign(1, Node_t{0, 0, 0, 0, 0, 0});
+            Keys.assign(1, 0);
+            Labels.clear();
+            NumNgrams = 0;
+        }
+
+        inline size_t Bytes() const {
+            return Nodes.capacity() * sizeof(Node_t) + Keys.capacity() + Labels.capacity();
+        }
+
+        // The id of an ngram (node) that no other live ngram of this or any trie shares
+        inline uint64_t Id(const uint32_t nidx) const { return (uint64_t)(Nodes.data() + nidx); }
+
+        // @param [begin, end) Lexicographically sorted ngrams (duplicates are skipped)
+        template<typename It>
+        void Build(It begin, It end) {
+            Clear();
+            std::vector<const std::string*> ngrams;
+            for (; begin != end; ++begin) {
+                if (!ngrams.empty() && *ngrams.back() == *begin) { continue; }
+                ngrams.push_back(&*begin);
+            }
+            NumNgrams = ngrams.size();
+
+            // (node, range of ngrams below it, bytes consumed at the node) in breadth first order
+            struct Pending_t { uint32_t Node; size_t Lo, Hi, Depth; };
+            std::vector<Pending_t> queue{Pending_t{0, 0, ngrams.size(), 0}};
+            for (size_t qh = 0; qh < queue.size(); ++qh) {
+                const Pending_t cur = queue[qh];
+                size_t lo = cur.Lo;
+                if (lo < cur.Hi && ngrams[lo]->size() == cur.Depth) {
+                    Nodes[cur.Node].Valid = 1;
+                    ++lo;
+                }
+                Nodes[cur.Node].FirstChild = Nodes.size();
+                while (lo < cur.Hi) {
+                    const uint8_t cb = (*ngrams[lo])[cur.Depth];
+                    size_t hi = lo+1;
+                    for (; hi < cur.Hi && (uint8_t)(*ngrams[hi])[cur.Depth] == cb; ++hi) {}
+                    // sorted so the common prefix of the group is that of its first and last ngram
+                    const std::string& first = *ngrams[lo];
+                    const std::string& last = *ngrams[hi-1];
+                    size_t lcp = cur.Depth+1;
+                    for (const size_t msz = std::min(first.size(), last.size()); lcp < msz && first[lcp] == last[lcp];) { ++lcp; }
+
+                    const uint32_t child = Nodes.size();
+                    Nodes.push_back(Node_t{0, (uint32_t)Labels.size(), (uint32_t)(lcp - cur.Depth - 1), 0, 0, 0});
+                    Keys.push_back(cb);
+                    Labels.insert(Labels.end(), first.begin() + cur.Depth + 1, first.begin() + lcp);
+                    Nodes[cur.Node].NumChildren++;
+                    queue.push_back(Pending_t{child, lo, hi, lcp});
+                    lo = hi;
+                }
+            }
+            Nodes.shrink_to_fit();
+            Keys.shrink_to_fit();
+            Labels.shrink_to_fit();
+        }
+
+        inline uint32_t _child(const Node_t& node, const uint8_t cb) const {
+            const uint8_t *keys = Keys.data() + node.FirstChild;
+            const size_t n = node.NumChildren;
+            if (n <= LINEAR_SEARCH_MAX) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (keys[i] == cb) { return node.FirstChild + i; }
+                }
+                return NOT_FOUND;
+            }
+            const uint8_t *it = std::lower_bound(keys, keys + n, cb);
+            return (it != keys + n && *it == cb) ? node.FirstChild + (it - keys) : NOT_FOUND;
+        }
+
+        // @return the node of the ngram s or NOT_FOUND if it is not in the trie
+        uint32_t Find(const char *s, const size_t sz) const {
+            uint32_t nidx = 0;
+            for (size_t bidx = 0; bidx < sz; ) {
+                nidx = _child(Nodes[nidx], s[bidx++]);
+                if (nidx == NOT_FOUND) { return NOT_FOUND; }
+                const auto& node = Nodes[nidx];
+                if (node.LabelLen > sz - bidx || std::memcmp(Labels.data() + node.LabelOff, s + bidx, node.LabelLen) != 0) {
+                    return NOT_FOUND;
+                }
+                bidx += node.LabelLen;
+            }
+            return Nodes[nidx].Valid ? nidx : NOT_FOUND;
+        }
+
+        // Like cy::trie::FindAll: appends (end, node) for every ngram that is a prefix of s ending at a word end
+        // @param examined Set to the number of bytes of s the results depend on (docSize+1 if also on where s ends)
+        void FindAll(const char *s, const size_t docSize, std::vector<std::pair<size_t, uint64_t>>& results, size_t *examined) const {
+            const uint8_t *bs = reinterpret_cast<const uint8_t*>(s);
+            uint32_t nidx = 0;
+            for (size_t bidx = 0; bidx < docSize; ) {
+                *examined = bidx+1;
+                nidx = _child(Nodes[nidx], bs[bidx++]);
+                if (nidx == NOT_FOUND) { return; }
+                const auto& node = Nodes[nidx];
+                if (node.LabelLen > docSize - bidx) { *examined = docSize+1; return; }
+                *examined = bidx + node.LabelLen;
+                if (std::memcmp(Labels.data() + node.LabelOff, s + bidx, node.LabelLen) != 0) { return; }
+                bidx += node.LabelLen;
+                *examined = bidx+1;
+                if (node.Valid && (bidx == docSize || bs[bidx] == ' ')) {
+                    results.emplace_back(bidx, nidx);
+                }
+            }
+            *examined = docSize+1;
+        }
+
+        // Calls f(const std::string& ngram, uint32_t node) for every ngram in lexicographic order
+        template<typename F>
+        void ForEachNgram(F f) const {
+            std::string prefix;
+            _forEach(0, prefix, f);
+        }
+
+        template<typename F>
+        void _forEach(const uint32_t nidx, std::string& prefix, F& f) const {
+            const auto& node = Nodes[nidx];
+            if (node.Valid) { f(prefix, nidx); }
+            const size_t psz = prefix.size();
+            for (uint32_t c = node.FirstChild, cend = node.FirstChild + node.NumChildren; c < cend; ++c) {
+                prefix.push_back(Keys[c]);
+                prefix.append(Labels.data() + Nodes[c].LabelOff, Nodes[c].LabelLen);
+                _forEach(c, prefix, f);
+                prefix.resize(psz);
+            }
+        }
+    };
+
+};
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __CY_MEMBERSHIP__
+#define __CY_MEMBERSHIP__
+
+#pragma once
+
+#include "CYUtils.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace cy {
+namespace member {
+
+    static inline uint64_t _fmix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // 64-bit hash of the bytes, 8 at a time
+    static inline uint64_t Fingerprint(const char *s, const size_t sz) {
+        uint64_t h = _fmix(sz ^ 0x9E3779B97F4A7C15ULL);
+        size_t i = 0;
+        for (; i+8 <= sz; i += 8) {
+            uint64_t w;
+            std::memcpy(&w, s+i, 8);
+            h = _fmix(h ^ w);
+        }
+        if (i < sz) {
+            uint64_t w = 0;
+            std::memcpy(&w, s+i, sz-i);
+            h = _fmix(h ^ w);
+        }
+        return h;
+    }
+
+    // The live ngrams of a shard as (fingerprint, length) in an open addressing table (linear probing,
+    // backward shift deletes), so an update that would not change the index is dropped in one probe.
+    // A missing fingerprint proves that an ngram is not live. A present one is only confirmed by the
+    // index itself (the isLive callback), since two ngrams of the same length can share a fingerprint:
+    // the slot is then marked Shared, and the updates of its ngrams always go to the index.
+    struct FingerprintSet_t {
+        struct Slot_t {
+            uint64_t Fp;
+            uint32_t Size;  // 0 for an empty slot
+            uint8_t First;  // the first byte, for moving the ngrams of a shard
+            bool Shared;    // more than one live ngram may have had this fingerprint (never cleared)
+        };
+
+        std::vector<Slot_t> Slots;
+        uint32_t Shift; // 64 - log2(Slots.size())
+        size_t Count;
+
+        FingerprintSet_t() : Slots(64, Slot_t{0, 0, 0, false}), Shift(64-6), Count(0) {}
+
+        inline size_t _find(const uint64_t fp, const uint32_t sz) const {
+            const size_t mask = Slots.size()-1;
+            for (size_t i = (fp * 0x9E3779B97F4A7C15ULL) >> Shift; ; i = (i+1) & mask) {
+                const auto& slot = Slots[i];
+                if (!slot.Size || (slot.Fp == fp && slot.Size == sz)) { return i; }
+            }
+        }
+
+        // Makes room for n ngrams without rehashing
+        void Reserve(const size_t n) {
+            size_t cap = Slots.size();
+            uint32_t shift = Shift;
+            while (n*2 > cap) { cap <<= 1; shift--; }
+            if (cap == Slots.size()) { return; }
+
+            std::vector<Slot_t> old(cap, Slot_t{0, 0, 0, false});
+            old.swap(Slots);
+            Shift = shift;
+            for (const auto& slot : old) {
+                if (slot.Size) { Slots[_find(slot.Fp, slot.Size)] = slot; }
+            }
+        }
+
+        // @param isLive Whether s is a live ngram of the index, only called on a fingerprint match
+        // @return true if s was not live, so the index has to add it
+        template<typename F>
+        inline bool Insert(const char *s, const size_t sz, F isLive) {
+            const uint64_t fp = Fingerprint(s, sz);
+            size_t i = _find(fp, sz);
+            if (Slots[i].Size) {
+                if (isLive()) { return false; }
+                Slots[i].Shared = true;
+                return true;
+            }
+            if (unlikely((Count+1)*2 > Slots.size())) {
+                Reserve(Count+1);
+                i = _find(fp, sz);
+            }
+            Slots[i] = Slot_t{fp, (uint32_t)sz, (uint8_t)s[0], false};
+            ++Count;
+            return true;
+        }
+
+        // @param isLive Whether s is a live ngram of the index, only called on a fingerprint match
+        // @return true if s was live, so the index has to remove it
+        template<typename F>
+        inline bool Erase(const char *s, const size_t sz, F isLive) {
+            const size_t i = _find(Fingerprint(s, sz), sz);
+            if (!Slots[i].Size || !isLive()) { return false; }
+            if (!Slots[i].Shared) { _erase(i); }
+            return true;
+        }
+
+        void _erase(size_t i) {
+            const size_t mask = Slots.size()-1;
+            for (size_t j = (i+1) & mask; Slots[j].Size; j = (j+1) & mask) {
+                const size_t home = (Slots[j].Fp * 0x9E3779B97F4A7C15ULL) >> Shift;
+                const bool inRange = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+                if (!inRange) {
+                    Slots[i] = Slots[j];
+                    i = j;
+                }
+            }
+            Slots[i].Size = 0;
+            --Count;
+        }
+
+        // Moves the ngrams starting with byte b to another set. The ngrams of a shared slot may start
+        // with other bytes too, so the slot is copied instead (a shared slot only costs index lookups).
+        void MoveFirstByte(FingerprintSet_t *to, const uint8_t b) {
+            std::vector<Slot_t> moved;
+            for (const auto& slot : Slots) {
+                if (slot.Size && (slot.First == b || slot.Shared)) { moved.push_back(slot); }
+            }
+            to->Reserve(to->Count + moved.size());
+            for (const auto& slot : moved) {
+                if (!slot.Shared) { _erase(_find(slot.Fp, slot.Size)); }
+                auto& dst = to->Slots[to->_find(slot.Fp, slot.Size)];
+                if (dst.Size) {
+                    dst.Shared = true;
+                    continue;
+                }
+                dst = slot;
+                to->Count++;
+            }
+        }
+
+        inline size_t Bytes() const { return Slots.capacity() * sizeof(Slot_t); }
+    };
+
+};
+};
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef __CY_NGRAM_HASH__
+#define __CY_NGRAM_HASH__
+
+#pragma once
+
+#include "CYUtils.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace cy {
+namespace hash {
+
+    constexpr uint64_t HASH_SEED = 14695981039346656037ULL;
+    constexpr uint64_t HASH_PRIME = 1099511628211ULL;
+    constexpr size_t MEMORY_POOL_BLOCK_SIZE_BYTES = 1<<20;
+
+    // The hash of a prefix extended by one byte, so a walk over a document has the hash of
+    // every prefix of it at hand (FNV-1a)
+    inline uint64_t Roll(const uint64_t h, const uint8_t b) { return (h ^ b) * HASH_PRIME; }
+
+    // The ngrams in an open addressing table (linear probing, backward shift deletes) keyed by
+    // the rolling hash of their bytes. Every word prefix of an ngram has an entry too, counting the
+    // ngrams it prefixes, so a walk that rolls the hash from a word start and probes at each word end
+    // stops at the first prefix no ngram has, like a trie walk at word granularity. The number of
+    // ngrams per word count (the length index) bounds the walk by the most words any ngram has.
+    struct NgramHash_t {
+        struct Entry_t {
+            uint64_t Hash;
+            const char *Data; // nullptr for an empty slot
+            uint32_t Size;
+            uint32_t Refs;    // the live ngrams this is a word prefix of (or equal to)
+            bool Valid;       // this is a live ngram
+        };
+
+        std::vector<Entry_t> Slots;
+        uint32_t Shift; // 64 - log2(Slots.size())
+        size_t Count;   // used slots
+        size_t NumNgrams;
+        std::vector<size_t> WordCounts; // live ngrams per number of words
+        size_t MaxWords;
+        size_t PoolBytes;
+
+        // The bytes of the entries, pooled and never freed. An entry points into the bytes of the
+        // ngram that created it, so the entries of a table end at distinct addresses.
+        std::vector<char*> _mBytes;
+        size_t _allocatedBytes;
+
+        NgramHash_t() : Slots(64, Entry_t{0, nullptr, 0, 0, false}), Shift(64-6), Count(0), NumNgrams(0), WordCounts(1, 0),
+                        MaxWords(0), PoolBytes(0), _allocatedBytes(MEMORY_POOL_BLOCK_SIZE_BYTES) {}
+        NgramHash_t(const NgramHash_t&) = delete;
+        NgramHash_t& operator=(const NgramHash_t&) = delete;
+        ~NgramHash_t() {
+            for (auto b : _mBytes) { delete[] b; }
+        }
+
+        // The id of an ngram, unique among the live ngrams of all the tables
+        static inline uint64_t Id(const Entry_t& e) { return (uint64_t)(e.Data + e.Size); }
+
+        inline size_t _home(const uint64_t h) const { return ((h ^ (h >> 32)) * 0x9E3779B97F4A7C15ULL) >> Shift; }
+
+        // @return the slot of the entry or of the empty slot ending its probe sequence
+        inline size_t _find(const uint64_t h, const char *s, const size_t sz) const {
+            const size_t mask = Slots.size()-1;
+            for (size_t i = _home(h); ; i = (i+1) & mask) {
+                const auto& e = Slots[i];
+                if (!e.Data || (e.Hash == h && e.Size == sz && std::memcmp(e.Data, s, sz) == 0)) { return i; }
+            }
+        }
+
+        inline const char* _newBytes(const char *s, const size_t sz) {
+            if (_allocatedBytes + sz > MEMORY_POOL_BLOCK_SIZE_BYTES) {
+                _mBytes.push_back(new char[std::max(sz, MEMORY_POOL_BLOCK_SIZE_BYTES)]);
+                _allocatedBytes = 0;
+            }
+            char *p = _mBytes.back() + _allocatedBytes;
+            std::memcpy(p, s, sz);
+            _allocatedBytes += sz;
+            PoolBytes += sz;
+            return p;
+        }
+
+        // Makes room for n entries without rehashing
+        void Reserve(const size_t n) {
+            size_t cap = Slots.size();
+            uint32_t shift = Shift;
+            while (n*2 > cap) { cap <<= 1; shift--; }
+            if (cap == Slots.size()) { return; }
+
+            std::vector<Entry_t> old(cap, Entry_t{0, nullptr, 0, 0, false});
+            old.swap(Slots);
+            Shift = shift;
+            const size_t mask = cap-1;
+            for (const auto& e : old) {
+                if (!e.Data) { continue; }
+                size_t i = _home(e.Hash);
+                while (Slots[i].Data) { i = (i+1) & mask; }
+                Slots[i] = e;
+            }
+        }
+
+        // Empties slot i and shifts back the entries after it that may not sit between their home slot and the hole
+        void _erase(size_t i) {
+            const size_t mask = Slots.size()-1;
+            for (size_t j = (i+1) & mask; Slots[j].Data; j = (j+1) & mask) {
+                const size_t home = _home(Slots[j].Hash);
+                const bool inRange = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+                if (!inRange) {
+                    Slots[i] = Slots[j];
+                    i = j;
+                }
+            }
+            Slots[i].Data = nullptr;
+            --Count;
+        }
+
+        // @return the entry of the ngram s if it is live
+        inline const Entry_t* _findNgram(const char *s, const size_t sz) const {
+            const uint64_t h = HashOf(s, sz);
+            const auto& e = Slots[_find(h, s, sz)];
+            return (e.Data && e.Valid) ? &e : nullptr;
+        }
+
+        static inline uint64_t HashOf(const char *s, const size_t sz) {
+            uint64_t h = HASH_SEED;
+            for (size_t i = 0; i < sz; ++i) { h = Roll(h, s[i]); }
+            return h;
+        }
+
+        void Add(const char *s, const size_t sz) {
+            if (_findNgram(s, sz)) { return; }
+            const size_t words = 1 + std::count(s, s+sz, ' ');
+            if (unlikely((Count+words)*2 > Slots.size())) { Reserve(Count+words); }
+
+            const char *data = nullptr; // allocated by the first new entry
+            uint64_t h = HASH_SEED;
+            for (size_t bidx = 0; ; ++bidx) {
+                if (bidx == sz || s[bidx] == ' ') {
+                    auto& e = Slots[_find(h, s, bidx)];
+                    if (!e.Data) {
+                        if (!data) { data = _newBytes(s, sz); }
+                        e = Entry_t{h, data, (uint32_t)bidx, 0, false};
+                        ++Count;
+                    }
+                    e.Refs++;
+                    if (bidx == sz) {
+                        e.Valid = true;
+                        break;
+                    }
+                }
+                h = Roll(h, s[bidx]);
+            }
+
+            ++NumNgrams;
+            if (words >= WordCounts.size()) { WordCounts.resize(words+1, 0); }
+            WordCounts[words]++;
+            MaxWords = std::max(MaxWords, words);
+        }
+
+        void Remove(const char *s, const size_t sz) {
+            if (!_findNgram(s, sz)) { return; }
+
+            uint64_t h = HASH_SEED;
+            for (size_t bidx = 0; ; ++bidx) {
+                if (bidx == sz || s[bidx] == ' ') {
+                    const size_t i = _find(h, s, bidx);
+                    auto& e = Slots[i];
+                    if (bidx == sz) { e.Valid = false; }
+                    if (--e.Refs == 0) { _erase(i); }
+                    if (bidx == sz) { break; }
+                }
+                h = Roll(h, s[bidx]);
+            }
+
+            --NumNgrams;
+            WordCounts[1 + std::count(s, s+sz, ' ')]--;
+            while (MaxWords && !WordCounts[MaxWords]) { --MaxWords; }
+        }
+
+        // Like cy::trie::FindAll: appends (end, id) for every ngram that is a prefix of s ending at a word end
+        // @param examined Set to the number of bytes of s the results depend on (docSize+1 if also on where s ends)
+        void FindAll(const char *s, const size_t docSize, std::vector<std::pair<size_t, uint64_t>>& results, size_t *examined) const {
+            *examined = 0;
+            if (!MaxWords) { return; }
+            const uint8_t *bs = reinterpret_cast<const uint8_t*>(s);
+            uint64_t h = HASH_SEED;
+            for (size_t bidx = 0, words = 0; ; ++bidx) {
+                if (bidx == docSize || bs[bidx] == ' ') {
+                    *examined = bidx+1;
+                    const auto& e = Slots[_find(h, s, bidx)];
+                    if (!e.Data) { return; } // no ngram starts with these words
+                    if (e.Valid) { results.emplace_back(bidx, Id(e)); }
+                    if (++words == MaxWords || bidx == docSize) { return; }
+                }
+                h = Roll(h, bs[bidx]);
+            }
+        }
+
+        // Moves the ngrams starting with byte b to another table
+        void MoveFirstByte(NgramHash_t *to, const uint8_t b) {
+            std::vector<std::string> moved;
+            for (const auto& e : Slots) {
+                if (e.Data && e.Valid && (uint8_t)e.Data[0] == b) { moved.emplace_back(e.Data, e.Size); }
+            }
+            for (const auto& s : moved) {
+                Remove(s.data(), s.size());
+                to->Add(s.data(), s.size());
+            }
+        }
+
+        inline size_t Bytes() const {
+            return Slots.capacity() * sizeof(Entry_t) + _mBytes.size() * MEMORY_POOL_BLOCK_SIZE_BYTES;
+        }
+    };
+
+};
+};
+
+#endif
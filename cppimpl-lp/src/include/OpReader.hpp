@@ -0,0 +1,257 @@
+#ifndef __CY_OP_READER__
+#define __CY_OP_READER__
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace cy {
+namespace io {
+
+    // Where the init ngrams and the workload ops come from. Both readers give the init ngrams
+    // one by one (NextInit) and then the ops with their payload, the line without the op and
+    // its space (Next), so the main loop is compiled once per reader without any dispatch.
+
+    // A client that sends this as its first line speaks the binary protocol (FrameReader_t) from
+    // the next byte on, otherwise that line is the first init ngram of the text protocol
+    static const char BINARY_PROTOCOL_LINE[] = "NGRAM-BINARY 1";
+
+    // The text protocol of the harness on a stream
+    struct StreamReader_t {
+        std::istream& In;
+        std::string Line;
+        bool HasFirst;
+        std::string First; // the line read to negotiate the protocol
+
+        explicit StreamReader_t(std::istream& in) : In(in), HasFirst(false) {}
+
+        // Gives back a line already read from the stream, the next NextInit returns it
+        inline void Unread(std::string line) {
+            HasFirst = true;
+            First = std::move(line);
+        }
+
+        // @return false at the "S" line that ends the init (or at the end of the stream)
+        inline bool NextInit(std::string& ngram) {
+            if (HasFirst) {
+                HasFirst = false;
+                ngram = std::move(First);
+            } else if (!std::getline(In, ngram)) {
+                std::cerr << "error" << std::endl;
+                return false;
+            }
+            return ngram != "S";
+        }
+
+        // The harness waits for this before it sends the workload
+        inline void Ready() { std::cout << "R" << std::endl; }
+
+        // @return false at the end of the stream
+        inline bool Next(char& op, std::string& payload) {
+            if (!std::getline(In, Line)) {
+                if (!In.eof()) { std::cerr << "Error" << std::endl; }
+                return false;
+            }
+            op = Line.empty() ? '\0' : Line[0];
+            payload.assign(Line, std::min<size_t>(2, Line.size()), std::string::npos);
+            return true;
+        }
+    };
+
+    // The binary protocol on a stream: every op is a frame of the op byte, its payload length
+    // (u32, little endian) and the payload, the same records as the replay files. The init is a
+    // run of 'A' frames ended by an 'S' frame and every batch ends with an 'F' frame. Nothing is
+    // scanned for newlines; the results go out as offsets into the documents (see outputResults).
+    struct FrameReader_t {
+        static constexpr size_t FRAME_HEADER = 5;
+
+        std::istream& In;
+
+        explicit FrameReader_t(std::istream& in) : In(in) {}
+
+        // @return false at the end of the stream (payload is left empty)
+        inline bool _frame(char& op, std::string& payload) {
+            char header[FRAME_HEADER];
+            if (!In.read(header, FRAME_HEADER)) {
+                if (In.gcount()) { std::cerr << "Error" << std::endl; }
+                return false;
+            }
+            uint32_t sz;
+            std::memcpy(&sz, header+1, sizeof(sz));
+            op = header[0];
+            payload.resize(sz);
+            if (sz && !In.read(&payload[0], sz)) {
+                std::cerr << "Error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // @return false at the 'S' frame that ends the init (or at the end of the stream)
+        inline bool NextInit(std::string& ngram) {
+            char op;
+            if (!_frame(op, ngram)) {
+                std::cerr << "error" << std::endl;
+                return false;
+            }
+            return op != 'S';
+        }
+
+        inline void Ready() { std::cout << "R" << std::endl; }
+
+        inline bool Next(char& op, std::string& payload) { return _frame(op, payload); }
+    };
+
+    // A workload recorded by test-harness/recorder, mapped in memory (the layout is the one of
+    // test-harness/replay.h). The ops are taken straight from the mapping instead of being parsed
+    // out of a pipe, and in timed mode every batch waits for its recorded time.
+    struct ReplayReader_t {
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t RECORD_HEADER = 5; // op byte and u32 payload length
+
+        struct Header_t {
+            char Magic[8];
+            uint32_t Version;
+            uint32_t Flags;
+            uint64_t InitOffset;
+            uint64_t InitSize;
+            uint64_t NumBatches;
+            uint64_t IndexOffset;
+        };
+        struct Batch_t {
+            uint64_t Offset;
+            uint64_t Size;
+            uint64_t TimeUs;
+            uint32_t Ops;
+            uint32_t Queries;
+        };
+
+        const char *Data = nullptr;
+        size_t Size = 0;
+        const Header_t *Header = nullptr;
+        const Batch_t *Batches = nullptr;
+        const char *Cur = nullptr;
+        const char *End = nullptr;
+        uint64_t BatchIdx = 0;
+        bool Timed = false;
+        std::chrono::steady_clock::time_point Start;
+
+        ReplayReader_t() = default;
+        ReplayReader_t(const ReplayReader_t&) = delete;
+        ReplayReader_t& operator=(const ReplayReader_t&) = delete;
+        ~ReplayReader_t() { if (Data) { munmap((void*)Data, Size); } }
+
+        // @param timed Replay the recorded time between the batches instead of running them back to back
+        // @return false if the file cannot be mapped, is not a replay file or has an offset or a
+        // record out of its bounds (everything is checked here, before anything is replayed)
+        bool Open(const char *path, const bool timed) {
+            const int fd = ::open(path, O_RDONLY);
+            if (fd == -1) { return false; }
+            struct stat st;
+            if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header_t)) { close(fd); return false; }
+            Size = st.st_size;
+            void *p = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) { Size = 0; return false; }
+            Data = (const char*)p;
+            madvise(p, Size, MADV_SEQUENTIAL);
+
+            Header = (const Header_t*)Data;
+            if (std::memcmp(Header->Magic, "NGREPLAY", sizeof(Header->Magic)) || Header->Version != VERSION
+                    || !_valid(Header->InitOffset, Header->InitSize)
+                    || Header->IndexOffset > Size
+                    || Header->NumBatches > (Size - Header->IndexOffset) / sizeof(Batch_t)) {
+                return false;
+            }
+            Batches = (const Batch_t*)(Data + Header->IndexOffset);
+            for (uint64_t b = 0; b < Header->NumBatches; ++b) {
+                if (!_valid(Batches[b].Offset, Batches[b].Size)) { return false; }
+            }
+            Cur = Data + Header->InitOffset;
+            End = Cur + Header->InitSize;
+            Timed = timed;
+            return true;
+        }
+
+        // Whether the size bytes at offset are in the file and made of whole records, checked
+        // without adding offsets that could overflow
+        bool _valid(const uint64_t offset, const uint64_t size) const {
+            if (offset >= Size || size > Size - offset) { return false; }
+            char op = '\0'; const char *payload = nullptr; uint32_t sz = 0;
+            for (const char *p = Data + offset, *end = p + size; p != end; ) {
+                p = _record(p, end, op, payload, sz);
+                if (!p) { return false; }
+            }
+            return true;
+        }
+
+        // @return the record after the one at p, nullptr if it runs past end (with an empty payload)
+        static inline const char* _record(const char *p, const char *end, char& op, const char *&payload, uint32_t& sz) {
+            op = '\0';
+            payload = p;
+            sz = 0;
+            if ((size_t)(end - p) < RECORD_HEADER) { return nullptr; }
+            std::memcpy(&sz, p+1, sizeof(sz));
+            if (sz > (size_t)(end - p) - RECORD_HEADER) { return nullptr; }
+            op = p[0];
+            payload = p + RECORD_HEADER;
+            return payload + sz;
+        }
+
+        inline bool NextInit(std::string& ngram) {
+            if (Cur == End) { return false; }
+            char op = '\0'; const char *payload = nullptr; uint32_t sz = 0;
+            const char *next = _record(Cur, End, op, payload, sz);
+            if (!next) {
+                Cur = End;
+                return false;
+            }
+            Cur = next;
+            ngram.assign(payload, sz);
+            return true;
+        }
+
+        // Nobody waits for the init, the workload follows in the same file
+        inline void Ready() {
+            Cur = End = nullptr;
+            Start = std::chrono::steady_clock::now();
+        }
+
+        inline bool Next(char& op, std::string& payload) {
+            // each batch is walked within its own bounds, as checked by Open
+            while (Cur == End) {
+                if (BatchIdx == Header->NumBatches) { return false; }
+                const auto& batch = Batches[BatchIdx++];
+                if (Timed) {
+                    std::this_thread::sleep_until(Start + std::chrono::microseconds(batch.TimeUs - Batches[0].TimeUs));
+                }
+                Cur = Data + batch.Offset;
+                End = Cur + batch.Size;
+            }
+            const char *p = nullptr; uint32_t sz = 0;
+            const char *next = _record(Cur, End, op, p, sz);
+            if (!next) {
+                Cur = End;
+                return false;
+            }
+            Cur = next;
+            payload.assign(p, sz);
+            return true;
+        }
+    };
+
+};
+};
+
+#endif
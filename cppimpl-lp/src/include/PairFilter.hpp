@@ -0,0 +1,115 @@
+#ifndef __CY_PAIR_FILTER__
+#define __CY_PAIR_FILTER__
+
+#pragma once
+
+#include "CYUtils.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace cy {
+namespace pairs {
+
+    constexpr size_t BITS_PER_PAIR = 16;
+    constexpr size_t PAIRS_PER_BLOCK = 256 / BITS_PER_PAIR;
+    constexpr size_t MIN_BLOCKS = 64;
+    constexpr size_t MIN_STALE_PAIRS = 1024; // for a rebuild
+
+    static inline uint64_t WordHash(const char *s, const size_t sz) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < sz; ++i) { h = (h ^ (uint8_t)s[i]) * 1099511628211ULL; }
+        return h;
+    }
+
+    // Calls f(prevWordHash, wordHash) for every two consecutive words of the ngram
+    template<typename F>
+    static inline void ForEachPair(const char *s, const size_t sz, F f) {
+        uint64_t prev = 0;
+        for (size_t start = 0, i = 0; i <= sz; ++i) {
+            if (i < sz && s[i] != ' ') { continue; }
+            const uint64_t h = WordHash(s+start, i-start);
+            if (start) { f(prev, h); }
+            prev = h;
+            start = i+1;
+        }
+    }
+
+    // A split block Bloom filter over the pairs of consecutive words of the ngrams: a pair sets one
+    // bit in each of the 8 words of its 32-byte block, so a lookup touches a single cache line.
+    // Deletes cannot clear bits; the filter only says a pair may exist, so stale bits just prune
+    // less, and the owner rebuilds it from the live ngrams once too many pairs were removed.
+    struct PairFilter_t {
+        struct Block_t { uint32_t W[8]; };
+
+        std::vector<Block_t> Blocks;
+        size_t Inserted; // pairs inserted since the last build (with repeats)
+        size_t Removed;  // pairs of the ngrams deleted since the last build (with repeats)
+
+        PairFilter_t() { Reset(0); }
+
+        // Empties the filter and sizes it for the given number of pairs
+        void Reset(const size_t pairs) {
+            Blocks.assign(std::max(MIN_BLOCKS, (pairs + PAIRS_PER_BLOCK - 1) / PAIRS_PER_BLOCK), Block_t{{0}});
+            Blocks.shrink_to_fit();
+            Inserted = Removed = 0;
+        }
+
+        inline size_t Capacity() const { return Blocks.size() * PAIRS_PER_BLOCK; }
+
+        // The filter is rebuilt when it holds more pairs than it was sized for or mostly stale ones
+        inline bool NeedsRebuild() const { return Inserted > Capacity() || (Removed >= MIN_STALE_PAIRS && Removed*2 > Inserted); }
+
+        static inline uint64_t _key(const uint64_t w1, const uint64_t w2) {
+            uint64_t h = w1 ^ ((w2 << 29) | (w2 >> 35)) ^ 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        static inline void _mask(const uint32_t k, uint32_t *m) {
+            static const uint32_t SALT[8] = { 0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                              0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U };
+            for (size_t i = 0; i < 8; ++i) { m[i] = 1U << ((k * SALT[i]) >> 27); }
+        }
+
+        inline Block_t& _block(const uint64_t key) { return Blocks[((key >> 32) * Blocks.size()) >> 32]; }
+        inline const Block_t& _block(const uint64_t key) const { return Blocks[((key >> 32) * Blocks.size()) >> 32]; }
+
+        inline void Insert(const uint64_t w1, const uint64_t w2) {
+            const uint64_t key = _key(w1, w2);
+            uint32_t m[8];
+            _mask(key, m);
+            auto& b = _block(key);
+            for (size_t i = 0; i < 8; ++i) { b.W[i] |= m[i]; }
+            ++Inserted;
+        }
+
+        inline bool MayContain(const uint64_t w1, const uint64_t w2) const {
+            const uint64_t key = _key(w1, w2);
+            uint32_t m[8];
+            _mask(key, m);
+            const auto& b = _block(key);
+            uint32_t missing = 0;
+            for (size_t i = 0; i < 8; ++i) { missing |= m[i] & ~b.W[i]; }
+            return !missing;
+        }
+
+        inline void InsertNgram(const char *s, const size_t sz) {
+            ForEachPair(s, sz, [&](const uint64_t w1, const uint64_t w2) { Insert(w1, w2); });
+        }
+
+        inline void RemoveNgram(const char *s, const size_t sz) {
+            Removed += std::count(s, s+sz, ' ');
+        }
+
+        inline size_t Bytes() const { return Blocks.capacity() * sizeof(Block_t); }
+    };
+
+};
+};
+
+#endif
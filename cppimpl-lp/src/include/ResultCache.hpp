@@ -0,0 +1,158 @@
+#ifndef __CY_RESULT_CACHE__
+#define __CY_RESULT_CACHE__
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace cy {
+namespace cache {
+
+    constexpr size_t EPOCH_BUCKETS = 1<<16;
+    // Bookkeeping bytes charged to each entry on top of the document and the result line
+    constexpr size_t ENTRY_OVERHEAD = 96;
+
+    // FNV-1a
+    static inline uint64_t HashBytes(const char *p, const size_t sz) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i=0; i<sz; ++i) {
+            h ^= (uint8_t)p[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // Modification epochs of the ngrams grouped by (the hash of) their first word.
+    // An ngram can only be part of the results of a document that contains its first word
+    // as a whole word, so an update only invalidates the cached results of such documents.
+    struct WordEpochs_t {
+        uint64_t Clock;
+        std::vector<uint64_t> LastModified;
+
+        WordEpochs_t() : Clock(0), LastModified(EPOCH_BUCKETS, 0) {}
+
+        static inline size_t _bucket(const char *w, const size_t sz) {
+            return HashBytes(w, sz) & (EPOCH_BUCKETS-1);
+        }
+
+        inline void Touch(const std::string& ngram) {
+            const char *p = ngram.data();
+            size_t end = 0;
+            for (const size_t sz = ngram.size(); end < sz && p[end] != ' '; ++end) {}
+            LastModified[_bucket(p, end)] = ++Clock;
+        }
+
+        // @return true if no ngram starting with any of the words of doc changed after epoch
+        bool UnchangedSince(const std::string& doc, const uint64_t epoch) const {
+            const char *p = doc.data();
+            const size_t sz = doc.size();
+            size_t start{0}, end{0};
+            for (; start < sz; ) {
+                for (start = end; start < sz && p[start] == ' '; ++start) {}
+                if (start >= sz) { break; }
+                for (end = start; end < sz && p[end] != ' '; ++end) {}
+                if (LastModified[_bucket(p+start, end-start)] > epoch) { return false; }
+            }
+            return true;
+        }
+    };
+
+    // Maps a document to its serialized output line, bounded by bytes with CLOCK eviction.
+    // Lookups and inserts are only done by the master thread outside the parallel regions,
+    // and the lines returned by Lookup() stay valid until the next Insert().
+    struct ResultCache_t {
+        struct Entry_t {
+            std::string Doc;
+            std::string Line;
+            uint64_t Hash;
+            uint64_t Epoch; // WordEpochs_t::Clock at the time the result was computed
+            bool Used;
+            bool Referenced;
+
+            Entry_t() : Hash(0), Epoch(0), Used(false), Referenced(false) {}
+
+            inline size_t Bytes() const { return Doc.size() + Line.size() + ENTRY_OVERHEAD; }
+        };
+
+        size_t Capacity;
+        size_t Bytes;
+        size_t Hand;
+        std::vector<Entry_t> Slots;
+        std::vector<size_t> FreeSlots;
+        std::unordered_map<uint64_t, size_t> Index; // document hash to slot
+
+        size_t Hits, Misses, Evictions;
+
+        ResultCache_t(const size_t capacity) : Capacity(capacity), Bytes(0), Hand(0), Hits(0), Misses(0), Evictions(0) {}
+
+        const std::string* Lookup(const std::string& doc, const uint64_t hash, const WordEpochs_t& epochs) {
+            const auto it = Index.find(hash);
+            if (it == Index.end()) { ++Misses; return nullptr; }
+            auto& e = Slots[it->second];
+            if (e.Doc != doc) { ++Misses; return nullptr; }
+            // Stale entries are left in place since an earlier query of the batch may hold their line.
+            // They get replaced when the fresh result is inserted.
+            if (!epochs.UnchangedSince(doc, e.Epoch)) { ++Misses; return nullptr; }
+            e.Referenced = true;
+            ++Hits;
+            return &e.Line;
+        }
+
+        void Insert(const std::string& doc, const uint64_t hash, const uint64_t epoch, std::string line) {
+            const size_t bytes = doc.size() + line.size() + ENTRY_OVERHEAD;
+            if (bytes > Capacity) { return; }
+
+            const auto it = Index.find(hash);
+            if (it != Index.end()) { _evict(it->second); }
+            while (Bytes + bytes > Capacity) { _evictNext(); }
+
+            size_t sidx = Slots.size();
+            if (!FreeSlots.empty()) {
+                sidx = FreeSlots.back();
+                FreeSlots.pop_back();
+            } else {
+                Slots.emplace_back();
+            }
+            auto& e = Slots[sidx];
+            e.Doc.assign(doc);
+            e.Line = std::move(line);
+            e.Hash = hash;
+            e.Epoch = epoch;
+            e.Used = true;
+            e.Referenced = false;
+            Bytes += e.Bytes();
+            Index[hash] = sidx;
+        }
+
+        void _evict(const size_t sidx) {
+            auto& e = Slots[sidx];
+            Bytes -= e.Bytes();
+            Index.erase(e.Hash);
+            e.Used = false;
+            e.Doc.clear(); e.Doc.shrink_to_fit();
+            e.Line.clear(); e.Line.shrink_to_fit();
+            FreeSlots.push_back(sidx);
+            ++Evictions;
+        }
+
+        // CLOCK: referenced entries get a second chance, the first unreferenced one goes
+        void _evictNext() {
+            for (;;) {
+                if (Hand >= Slots.size()) { Hand = 0; }
+                auto& e = Slots[Hand++];
+                if (!e.Used) { continue; }
+                if (e.Referenced) { e.Referenced = false; continue; }
+                _evict(Hand-1);
+                return;
+            }
+        }
+    };
+
+};
+};
+
+#endif
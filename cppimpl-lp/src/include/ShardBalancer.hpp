@@ -0,0 +1,105 @@
+#ifndef __CY_SHARD_BALANCER__
+#define __CY_SHARD_BALANCER__
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+namespace cy {
+namespace shard {
+
+    constexpr double LOAD_EWMA_ALPHA = 0.3;
+    constexpr double IMBALANCE_THRESHOLD = 1.2; // the most loaded shard over the mean load
+    constexpr size_t MAX_MOVES_PER_BATCH = 4;
+
+    struct Move_t {
+        uint8_t Byte;
+        uint8_t From;
+        uint8_t To;
+    };
+
+    // Assigns every first byte of a word (a subtrie under the trie root) to a shard and
+    // moves bytes from the most to the least loaded shard when their query times drift apart.
+    // The table is only changed by the master between batches, so the workers read it without locks.
+    struct Balancer_t {
+        size_t NumShards;
+        uint8_t *ShardOf;
+        double ByteLoad[256]; // EWMA of the query microseconds spent on the words starting with each byte
+        size_t Migrations;
+
+        Balancer_t(uint8_t *shardOf, const size_t nshards) : NumShards(nshards), ShardOf(shardOf), Migrations(0) {
+            for (size_t b=0; b<256; ++b) {
+                ShardOf[b] = b % nshards;
+                ByteLoad[b] = 0;
+            }
+        }
+
+        // The time of a shard is split over its bytes by the trie walks they caused.
+        // @param shardTime The query microseconds of each shard in the last batch
+        // @param byteWalks The trie walks of each shard per first byte in the last batch
+        void Observe(const std::vector<uint64_t>& shardTime, const std::vector<const uint32_t*>& byteWalks) {
+            for (size_t sidx=0; sidx<NumShards; ++sidx) {
+                const uint32_t *walks = byteWalks[sidx];
+                uint64_t total = 0;
+                for (size_t b=0; b<256; ++b) { total += walks[b]; }
+                const double perWalk = total ? double(shardTime[sidx]) / total : 0.0;
+                for (size_t b=0; b<256; ++b) {
+                    if (ShardOf[b] != sidx) { continue; }
+                    ByteLoad[b] = LOAD_EWMA_ALPHA * (walks[b] * perWalk) + (1-LOAD_EWMA_ALPHA) * ByteLoad[b];
+                }
+            }
+        }
+
+        // @return The estimated load of the busiest shard over the mean load (1 if there is no load yet)
+        double Skew() const {
+            std::vector<double> load(NumShards, 0.0);
+            double total = 0;
+            for (size_t b=0; b<256; ++b) {
+                load[ShardOf[b]] += ByteLoad[b];
+                total += ByteLoad[b];
+            }
+            if (total <= 0) { return 1.0; }
+            return *std::max_element(load.begin(), load.end()) / (total / NumShards);
+        }
+
+        // Updates the table and appends the moves the caller has to apply to the shards
+        void Plan(std::vector<Move_t>& moves) {
+            std::vector<double> load(NumShards, 0.0);
+            double total = 0;
+            for (size_t b=0; b<256; ++b) {
+                load[ShardOf[b]] += ByteLoad[b];
+                total += ByteLoad[b];
+            }
+            const double mean = total / NumShards;
+            if (mean <= 0) { return; }
+
+            for (size_t m=0; m<MAX_MOVES_PER_BATCH; ++m) {
+                const size_t hi = std::max_element(load.begin(), load.end()) - load.begin();
+                const size_t lo = std::min_element(load.begin(), load.end()) - load.begin();
+                if (load[hi] <= mean * IMBALANCE_THRESHOLD) { break; }
+
+                // A byte lighter than the gap narrows it, the best one halves it
+                const double gap = load[hi] - load[lo];
+                int best = -1;
+                for (size_t b=0; b<256; ++b) {
+                    if (ShardOf[b] != hi || ByteLoad[b] <= 0 || ByteLoad[b] >= gap) { continue; }
+                    if (best < 0 || std::abs(ByteLoad[b] - gap/2) < std::abs(ByteLoad[best] - gap/2)) { best = b; }
+                }
+                if (best < 0) { break; }
+
+                ShardOf[best] = lo;
+                load[hi] -= ByteLoad[best];
+                load[lo] += ByteLoad[best];
+                moves.push_back(Move_t{(uint8_t)best, (uint8_t)hi, (uint8_t)lo});
+                ++Migrations;
+            }
+        }
+    };
+
+};
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef __CY_SHM_RING__
+#define __CY_SHM_RING__
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
+
+namespace cy {
+namespace io {
+
+    // The engine side of the shared memory transport of the harness (the layout is the one of
+    // test-harness/shm_ring.h): a memfd passed in NGRAM_SHM_FD with a request ring of binary
+    // protocol frames and a response ring for what would go to stdout. No frame wraps around the
+    // end of the ring, so each one is read with a single copy of its payload (the op keeps it: a
+    // batch is only run at its 'F' frame and may not fit in the ring, so its frames are released
+    // as they are read), and the results are copied straight into the response ring. Each side
+    // sleeps on its own futex doorbell only when it has nothing to do.
+    struct ShmChannel_t {
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t DATA_OFFSET = 4096;
+        static constexpr size_t FRAME_HEADER = 5;
+        static constexpr int SPINS = 4096;
+        static constexpr long WAIT_NS = 100000000; // the longest sleep, to notice a client that died
+
+        struct Bell_t {
+            alignas(64) std::atomic<uint32_t> Seq;
+            std::atomic<uint32_t> Waiting;
+        };
+        struct Ring_t {
+            alignas(64) std::atomic<uint64_t> Head; // written by the producer
+            alignas(64) std::atomic<uint64_t> Tail; // released by the consumer
+        };
+        struct Header_t {
+            char Magic[8];
+            uint32_t Version;
+            std::atomic<uint32_t> Closed; // the client sends no more requests
+            uint64_t RingSize;            // a power of 2
+            Bell_t EngineBell;            // rung by the client
+            Bell_t ClientBell;            // rung by the engine
+            Ring_t Requests;
+            Ring_t Responses;
+        };
+
+        Header_t *Header = nullptr;
+        size_t Size = 0;
+        const char *Requests = nullptr;
+        char *Responses = nullptr;
+        uint64_t Mask = 0;
+        uint64_t ReqTail = 0;      // consumed, released to the client every 1/8th of the ring and before a wait
+        uint64_t ReqReleased = 0;
+        uint64_t RespHead = 0;     // written, published by Flush
+        pid_t Parent = 0;
+
+        ShmChannel_t() = default;
+        ShmChannel_t(const ShmChannel_t&) = delete;
+        ShmChannel_t& operator=(const ShmChannel_t&) = delete;
+        ~ShmChannel_t() { if (Header) { munmap((void*)Header, Size); } }
+
+        // @return false if fd is not the shared memory of a client
+        bool Open(const int fd) {
+            struct stat st;
+            if (fstat(fd, &st) == -1 || (size_t)st.st_size < DATA_OFFSET) { return false; }
+            Size = st.st_size;
+            void *p = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) { Size = 0; return false; }
+            Header = (Header_t*)p;
+            const uint64_t ring = Header->RingSize;
+            if (std::memcmp(Header->Magic, "NGSHMRNG", sizeof(Header->Magic)) || Header->Version != VERSION
+                    || !ring || (ring & (ring-1)) || DATA_OFFSET + 2*ring > Size) {
+                return false;
+            }
+            Requests = (const char*)p + DATA_OFFSET;
+            Responses = (char*)p + DATA_OFFSET + ring;
+            Mask = ring - 1;
+            ReqTail = ReqReleased = Header->Requests.Tail.load();
+            RespHead = Header->Responses.Head.load();
+            Parent = getppid();
+            return true;
+        }
+
+        static inline void _ring(Bell_t& bell) {
+            bell.Seq.fetch_add(1);
+            if (bell.Waiting.load()) { syscall(SYS_futex, &bell.Seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0); }
+        }
+
+        // Waits on the engine doorbell until ready() holds or the client is gone
+        // @return ready()
+        template<typename F>
+        inline bool _wait(F ready) {
+            for (int i = 0; i < SPINS; ++i) {
+                if (ready()) { return true; }
+                _mm_pause();
+            }
+            auto& bell = Header->EngineBell;
+            for (;;) {
+                const uint32_t seq = bell.Seq.load();
+                bell.Waiting.store(1);
+                if (ready()) { break; }
+                struct timespec timeout = { 0, WAIT_NS };
+                syscall(SYS_futex, &bell.Seq, FUTEX_WAIT, seq, &timeout, nullptr, 0);
+                if (getppid() != Parent) { break; }
+            }
+            bell.Waiting.store(0);
+            return ready();
+        }
+
+        inline void _releaseRequests() {
+            if (ReqTail == ReqReleased) { return; }
+            Header->Requests.Tail.store(ReqTail, std::memory_order_release);
+            ReqReleased = ReqTail;
+            _ring(Header->ClientBell);
+        }
+
+        // The next frame, in the ring until ReqTail moves past it
+        // @return nullptr once the client closed the channel and everything was read
+        inline const char* _frame() {
+            for (;;) {
+                const uint64_t avail = Header->Requests.Head.load(std::memory_order_acquire) - ReqTail;
+                if (!avail) {
+                    _releaseRequests();
+                    const bool ready = _wait([&]() {
+                        return Header->Requests.Head.load(std::memory_order_acquire) != ReqTail || Header->Closed.load();
+                    });
+                    if (!ready || Header->Requests.Head.load(std::memory_order_acquire) == ReqTail) { return nullptr; }
+                    continue;
+                }
+                // the client skips the end of the ring when the next frame does not fit in it
+                const uint64_t pos = ReqTail & Mask;
+                const uint64_t toEnd = Mask + 1 - pos;
+                if (toEnd < FRAME_HEADER || Requests[pos] == '\0') {
+                    ReqTail += toEnd;
+                    continue;
+                }
+                if (ReqTail - ReqReleased >= (Mask + 1) / 8) { _releaseRequests(); }
+                return Requests + pos;
+            }
+        }
+
+        inline bool _next(char& op, std::string& payload) {
+            const char *frame = _frame();
+            if (!frame) { return false; }
+            uint32_t sz;
+            std::memcpy(&sz, frame+1, sizeof(sz));
+            op = frame[0];
+            payload.assign(frame + FRAME_HEADER, sz);
+            ReqTail += FRAME_HEADER + sz;
+            return true;
+        }
+
+        // The reader interface of OpReader.hpp
+
+        inline bool NextInit(std::string& ngram) {
+            char op;
+            if (!_next(op, ngram)) {
+                std::cerr << "error" << std::endl;
+                return false;
+            }
+            return op != 'S';
+        }
+
+        inline void Ready() {
+            Write("R\n", 2);
+            Flush();
+        }
+
+        inline bool Next(char& op, std::string& payload) { return _next(op, payload); }
+
+        // Copies bytes to the response ring, waiting for the client to make room if it is full
+        inline void Write(const char *p, size_t sz) {
+            auto& ring = Header->Responses;
+            while (sz) {
+                uint64_t space = Mask + 1 - (RespHead - ring.Tail.load(std::memory_order_acquire));
+                if (!space) {
+                    Flush();
+                    _releaseRequests();
+                    if (!_wait([&]() { return RespHead - ring.Tail.load(std::memory_order_acquire) <= Mask; })) { return; }
+                    continue;
+                }
+                const uint64_t pos = RespHead & Mask;
+                const size_t n = std::min<size_t>(sz, std::min<uint64_t>(space, Mask + 1 - pos));
+                std::memcpy(Responses + pos, p, n);
+                RespHead += n; p += n; sz -= n;
+            }
+        }
+
+        // Publishes the written responses to the client
+        inline void Flush() {
+            Header->Responses.Head.store(RespHead, std::memory_order_release);
+            _ring(Header->ClientBell);
+        }
+    };
+
+};
+};
+
+#endif
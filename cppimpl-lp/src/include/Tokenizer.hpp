@@ -0,0 +1,93 @@
+#ifndef __CY_TOKENIZER__
+#define __CY_TOKENIZER__
+
+#pragma once
+
+#include "CYUtils.hpp"
+#include "CpuDispatch.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#include <immintrin.h>
+
+namespace cy {
+namespace tok {
+
+    // The word starts of s[i, sz) one byte at a time
+    // @param prevSpace 1 if the byte before s[i] is a space (or i is 0)
+    static inline void _findWordStartsTail(const char *s, size_t i, const size_t sz, uint32_t prevSpace, std::vector<uint32_t>& starts) {
+        for (; i < sz; ++i) {
+            const uint32_t sp = s[i] == ' ';
+            if (!sp && prevSpace) { starts.push_back(i); }
+            prevSpace = sp;
+        }
+    }
+
+    static void _findWordStartsSse2(const char *s, const size_t sz, std::vector<uint32_t>& starts) {
+        const __m128i spaces = _mm_set1_epi8(' ');
+        uint32_t prevSpace = 1;
+        size_t i = 0;
+        for (; i + 16 <= sz; i += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+            const uint32_t sp = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, spaces));
+            uint32_t ws = ~sp & ((sp << 1) | prevSpace) & 0xFFFF;
+            prevSpace = sp >> 15;
+            while (ws) {
+                starts.push_back(i + __builtin_ctz(ws));
+                ws &= ws - 1;
+            }
+        }
+        _findWordStartsTail(s, i, sz, prevSpace, starts);
+    }
+
+    __attribute__((target("avx2"))) static void _findWordStartsAvx2(const char *s, const size_t sz, std::vector<uint32_t>& starts) {
+        const __m256i spaces = _mm256_set1_epi8(' ');
+        uint32_t prevSpace = 1;
+        size_t i = 0;
+        for (; i + 32 <= sz; i += 32) {
+            const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+            const uint32_t sp = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, spaces));
+            uint32_t ws = ~sp & ((sp << 1) | prevSpace);
+            prevSpace = sp >> 31;
+            while (ws) {
+                starts.push_back(i + __builtin_ctz(ws));
+                ws &= ws - 1;
+            }
+        }
+        _findWordStartsTail(s, i, sz, prevSpace, starts);
+    }
+
+    __attribute__((target("avx512bw"))) static void _findWordStartsAvx512(const char *s, const size_t sz, std::vector<uint32_t>& starts) {
+        const __m512i spaces = _mm512_set1_epi8(' ');
+        uint64_t prevSpace = 1;
+        size_t i = 0;
+        for (; i + 64 <= sz; i += 64) {
+            const uint64_t sp = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(s + i), spaces);
+            uint64_t ws = ~sp & ((sp << 1) | prevSpace);
+            prevSpace = sp >> 63;
+            while (ws) {
+                starts.push_back(i + __builtin_ctzll(ws));
+                ws &= ws - 1;
+            }
+        }
+        _findWordStartsTail(s, i, sz, prevSpace, starts);
+    }
+
+    // Fills starts with the offset of every word start in s, i.e. every non-space byte
+    // at offset 0 or right after a space.
+    // The spaces are found 16, 32 or 64 bytes at a time (by the CPU level): a word starts wherever
+    // the space mask has a 0 bit preceded by a 1 bit (the bit before offset 0 counts as a space).
+    static void FindWordStarts(const char *s, const size_t sz, std::vector<uint32_t>& starts) {
+        starts.clear();
+        switch (cy::cpu::LEVEL) {
+            case cy::cpu::Level_t::AVX512BW: _findWordStartsAvx512(s, sz, starts); break;
+            case cy::cpu::Level_t::AVX2: _findWordStartsAvx2(s, sz, starts); break;
+            default: _findWordStartsSse2(s, sz, starts); break;
+        }
+    }
+
+};
+};
+
+#endif
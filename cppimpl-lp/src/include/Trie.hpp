@@ -15,7 +15,10 @@
 
 #include "Timer.hpp"
 #include "CYUtils.hpp"
+#include "CpuDispatch.hpp"
+#include "PairFilter.hpp"
 #include "cpp_btree/btree_map.h"
+#include "cpp_btree/btree_set.h"
 
 #include <iostream>
 #include <vector>
@@ -28,29 +31,40 @@
 #include <cstring>
 
 #include <emmintrin.h>
+#include <immintrin.h>
 
 //#define LPDEBUG 1
 
 //#define USE_TYPE_X
+#define USE_PAIR_FILTER
 
 namespace cy {
 namespace trie {
 
     template<typename K, typename V>
         using Map = btree::btree_map<K, V>;
+    template<typename K, typename C>
+        using Set = btree::btree_set<K, C>;
 
     enum class OpType : uint8_t { ADD = 0, DEL = 1 };
-    enum class NodeType : uint8_t { S = 0, M = 1, L = 2, X = 3 };
+    enum class NodeType : uint8_t { S = 0, M = 1, L = 2, X = 3, W = 4 };
+    constexpr size_t NUM_NODE_TYPES = 5;
 
     constexpr size_t TYPE_S_MAX = 4;
     constexpr size_t TYPE_M_MAX = 16;
+    constexpr size_t TYPE_W_MAX = 32;
     constexpr size_t TYPE_L_MAX = 256;
+    // Ngram tails splitting a leaf at this depth or deeper go to X nodes (with USE_TYPE_X).
+    // TYPE_X_DEPTH is the default and the upper bound of the depth picked by AddSorted.
     constexpr size_t TYPE_X_DEPTH = 24;
+    constexpr size_t TYPE_X_MIN_DEPTH = 8;
 
     constexpr size_t MEMORY_POOL_BLOCK_SIZE_S = 1<<25;
     constexpr size_t MEMORY_POOL_BLOCK_SIZE_M = 1<<10;
+    constexpr size_t MEMORY_POOL_BLOCK_SIZE_W = 1<<10;
     constexpr size_t MEMORY_POOL_BLOCK_SIZE_L = 1<<10;
     constexpr size_t MEMORY_POOL_BLOCK_SIZE_X = 1<<10;
+    constexpr size_t MEMORY_POOL_BLOCK_SIZE_TAILS = 1<<20; // bytes
 
     //////////////////////////////////////////
     // Forward declarations to compile!
@@ -59,24 +73,36 @@ namespace trie {
     struct TrieNodeL_t;
     struct TrieNodeS_t;
     struct TrieNodeM_t;
+    struct TrieNodeW_t;
     struct TrieNodeX_t;
-    union NodePtr;
+    struct NodePtr;
 
     /////////////////////////////////////////
-    union NodePtr {
-        TrieNodeS_t *S;
-        TrieNodeM_t *M;
-        TrieNodeL_t *L;
-        TrieNodeX_t *X;
+    // A pointer to a node of any type with the type in its low bits (the nodes are at least 8 byte
+    // aligned), so a walk dispatches on the pointer it already holds instead of loading the node first.
+    // The accessors strip the tag and do not check it: the common fields (Type, Valid, Suffix) are at
+    // the same offsets in all the types, so any accessor reads them.
+    struct NodePtr {
+        static constexpr uintptr_t TAG_MASK = 7;
 
-        NodePtr() {}
-        NodePtr(std::nullptr_t t) : L(nullptr) {(void)t;}
-        NodePtr(TrieNodeS_t *s) : S(s) {}
-        NodePtr(TrieNodeM_t *m) : M(m) {}
-        NodePtr(TrieNodeL_t *l) : L(l) {}
-        NodePtr(TrieNodeX_t *x) : X(x) {}
+        uintptr_t Bits;
 
-        inline operator bool() const { return L != nullptr; }
+        NodePtr() {}
+        NodePtr(std::nullptr_t t) : Bits(0) {(void)t;}
+        NodePtr(TrieNodeS_t *s) : Bits((uintptr_t)s | (uintptr_t)NodeType::S) {}
+        NodePtr(TrieNodeM_t *m) : Bits((uintptr_t)m | (uintptr_t)NodeType::M) {}
+        NodePtr(TrieNodeW_t *w) : Bits((uintptr_t)w | (uintptr_t)NodeType::W) {}
+        NodePtr(TrieNodeL_t *l) : Bits((uintptr_t)l | (uintptr_t)NodeType::L) {}
+        NodePtr(TrieNodeX_t *x) : Bits((uintptr_t)x | (uintptr_t)NodeType::X) {}
+
+        inline NodeType Type() const { return (NodeType)(Bits & TAG_MASK); }
+        inline TrieNodeS_t* S() const { return reinterpret_cast<TrieNodeS_t*>(Bits & ~TAG_MASK); }
+        inline TrieNodeM_t* M() const { return reinterpret_cast<TrieNodeM_t*>(Bits & ~TAG_MASK); }
+        inline TrieNodeW_t* W() const { return reinterpret_cast<TrieNodeW_t*>(Bits & ~TAG_MASK); }
+        inline TrieNodeL_t* L() const { return reinterpret_cast<TrieNodeL_t*>(Bits & ~TAG_MASK); }
+        inline TrieNodeX_t* X() const { return reinterpret_cast<TrieNodeX_t*>(Bits & ~TAG_MASK); }
+
+        inline operator bool() const { return Bits != 0; }
     };
 
     template<size_t SIZE>
@@ -92,14 +118,14 @@ namespace trie {
 
     struct TrieNodeS_t {
         const NodeType Type = NodeType::S;
-        bool Valid;
+        bool Valid = false;
         std::string Suffix;
 
         DataS<TYPE_S_MAX> DtS;
     };
     struct TrieNodeM_t {
         const NodeType Type = NodeType::M;
-        bool Valid;
+        bool Valid = false;
         std::string Suffix;
 
         // 40 bytes so far. To be 16-bit aligned for SIMD we need to pad some bytes
@@ -107,23 +133,52 @@ namespace trie {
 
         DataS<TYPE_M_MAX> DtM;
     } ALIGNED_16;
+    // Between M and L: the keys are compared 32 at once (two SSE2 compares or one AVX2 compare)
+    // so a node with 17 to 32 children takes a fraction of the memory of an L node.
+    struct TrieNodeW_t {
+        const NodeType Type = NodeType::W;
+        bool Valid = false;
+        std::string Suffix;
+
+        DataS<TYPE_W_MAX> DtW;
+    } ALIGNED_16;
     struct TrieNodeL_t {
         const NodeType Type = NodeType::L;
-        bool Valid;
+        bool Valid = false;
         std::string Suffix;
 
         struct DataL {
             NodePtr Children[256];
         } DtL;
     };
+
+    // A key of the X nodes, pointing into the tails arena of the pool (or into the searched text)
+    struct StrView_t {
+        const char *Data;
+        uint32_t Size;
+
+        StrView_t() : Data(nullptr), Size(0) {}
+        StrView_t(const char *d, const size_t sz) : Data(d), Size(sz) {}
+    };
+    struct StrViewLess_t {
+        inline bool operator()(const StrView_t& l, const StrView_t& r) const {
+            const int c = std::memcmp(l.Data, r.Data, std::min(l.Size, r.Size));
+            return c < 0 || (c == 0 && l.Size < r.Size);
+        }
+    };
+
+    // A node without children that keeps the remaining bytes (tail) of each ngram going through it.
+    // It replaces the chains of single child nodes that deep suffix leaves are split into.
     struct TrieNodeX_t {
         const NodeType Type = NodeType::X;
         bool Valid;
+        std::string Suffix; // always empty, it keeps the common fields at the same offsets as the other types
 
-        // TODO Optimization
-        // TODO Create a custom String class that does not copy the contents of the char* for each key
-        Map<std::string, NodePtr> ChildrenMap;
+        uint32_t MaxLen; // of the tails ever added, so a lookup never needs to look further in the doc
+        Set<StrView_t, StrViewLess_t> Tails;
     };
+    static_assert(alignof(TrieNodeS_t) > NodePtr::TAG_MASK && alignof(TrieNodeM_t) > NodePtr::TAG_MASK && alignof(TrieNodeW_t) > NodePtr::TAG_MASK &&
+                  alignof(TrieNodeL_t) > NodePtr::TAG_MASK && alignof(TrieNodeX_t) > NodePtr::TAG_MASK, "no room for the NodePtr tag");
 
 
     /////////////////////////////
@@ -134,13 +189,17 @@ namespace trie {
     public:
     ////////////////////////////////////////
 
-        MemoryPool_t() : allocatedS(0), allocatedL(0), allocatedX(0) {
+        // @param blockS Nodes per S block, smaller for short-lived tries
+        MemoryPool_t(const size_t blockS = MEMORY_POOL_BLOCK_SIZE_S) : BlockS(blockS), allocatedS(0), allocatedM(0), allocatedW(0), allocatedL(0), allocatedX(0), allocatedTails(0) {
             _mS.reserve(128);
-            _mS.push_back(new TrieNodeS_t[MEMORY_POOL_BLOCK_SIZE_S]);
+            _mS.push_back(new TrieNodeS_t[BlockS]);
 
             _mM.reserve(4);
             _mM.push_back(new TrieNodeM_t[MEMORY_POOL_BLOCK_SIZE_M]);
 
+            _mW.reserve(4);
+            _mW.push_back(new TrieNodeW_t[MEMORY_POOL_BLOCK_SIZE_W]);
+
             _mL.reserve(4);
             _mL.push_back(new TrieNodeL_t[MEMORY_POOL_BLOCK_SIZE_L]);
 #ifdef USE_TYPE_X
@@ -148,11 +207,22 @@ namespace trie {
             _mX.push_back(new TrieNodeX_t[MEMORY_POOL_BLOCK_SIZE_X]);
 #endif
         }
+        MemoryPool_t(const MemoryPool_t&) = delete;
+        MemoryPool_t& operator=(const MemoryPool_t&) = delete;
+
+        ~MemoryPool_t() {
+            for (auto b : _mS) { delete[] b; }
+            for (auto b : _mM) { delete[] b; }
+            for (auto b : _mW) { delete[] b; }
+            for (auto b : _mL) { delete[] b; }
+            for (auto b : _mX) { delete[] b; }
+            for (auto b : _mTails) { delete[] b; }
+        }
 
         inline TrieNodeS_t* _newNodeS() {
             //return new TrieNodeS_t();
-            if (allocatedS >= MEMORY_POOL_BLOCK_SIZE_S) {
-                _mS.push_back(new TrieNodeS_t[MEMORY_POOL_BLOCK_SIZE_S]);
+            if (allocatedS >= BlockS) {
+                _mS.push_back(new TrieNodeS_t[BlockS]);
                 allocatedS = 0;
             }
             return _mS.back() + allocatedS++;
@@ -166,6 +236,14 @@ namespace trie {
             return _mM.back() + allocatedM++;
         }
 
+        inline TrieNodeW_t* _newNodeW() {
+            if (allocatedW >= MEMORY_POOL_BLOCK_SIZE_W) {
+                _mW.push_back(new TrieNodeW_t[MEMORY_POOL_BLOCK_SIZE_W]);
+                allocatedW = 0;
+            }
+            return _mW.back() + allocatedW++;
+        }
+
         inline TrieNodeL_t* _newNodeL() {
             //return new TrieNodeL_t();
             if (allocatedL >= MEMORY_POOL_BLOCK_SIZE_L) {
@@ -184,17 +262,36 @@ namespace trie {
             return _mX.back() + allocatedX++;
         }
 
+        // The copy of an X node tail, never freed like the nodes (the arena blocks are created on demand)
+        inline const char* _newTail(const char *s, const size_t sz) {
+            if (_mTails.empty() || allocatedTails + sz > MEMORY_POOL_BLOCK_SIZE_TAILS) {
+                _mTails.push_back(new char[std::max(sz, MEMORY_POOL_BLOCK_SIZE_TAILS)]);
+                allocatedTails = 0;
+            }
+            char *tail = _mTails.back() + allocatedTails;
+            std::memcpy(tail, s, sz);
+            allocatedTails += sz;
+            return tail;
+        }
+
+        size_t BlockS;
         std::vector<TrieNodeS_t*> _mS;
         size_t allocatedS; // nodes given from the latest block
 
         std::vector<TrieNodeM_t*> _mM;
         size_t allocatedM; // nodes given from the latest block
 
+        std::vector<TrieNodeW_t*> _mW;
+        size_t allocatedW; // nodes given from the latest block
+
         std::vector<TrieNodeL_t*> _mL;
         size_t allocatedL; // nodes given from the latest block
 
         std::vector<TrieNodeX_t*> _mX;
         size_t allocatedX; // nodes given from the latest block
+
+        std::vector<char*> _mTails;
+        size_t allocatedTails; // bytes given from the latest block
     };
 
     static inline NodePtr _newTrieNodeS(MemoryPool_t*mem) {
@@ -203,23 +300,19 @@ namespace trie {
     static inline NodePtr _newTrieNodeM(MemoryPool_t*mem) {
         return mem->_newNodeM();
     }
+    static inline NodePtr _newTrieNodeW(MemoryPool_t*mem) {
+        return mem->_newNodeW();
+    }
     static inline NodePtr _newTrieNodeL(MemoryPool_t*mem) {
         TrieNodeL_t *node = mem->_newNodeL();
         std::memset(node->DtL.Children, 0, TYPE_L_MAX * sizeof(NodePtr*));
         return node;
     }
     static inline NodePtr _newTrieNodeX(MemoryPool_t*mem) {
-        return mem->_newNodeX();
-    }
-    static inline NodePtr _newTrieNodeWithX(MemoryPool_t*mem, size_t depth = 0) {(void)depth;
-#ifdef USE_TYPE_X
-        if (depth < TYPE_X_DEPTH) {
-            return _newTrieNodeS(mem);
-        }
-        return _newTrieNodeX(mem);
-#else
-        return _newTrieNodeS(mem);
-#endif
+        auto node = mem->_newNodeX();
+        node->Valid = false;
+        node->MaxLen = 0;
+        return node;
     }
 
     static inline NodePtr _newTrieNode(MemoryPool_t*mem) {
@@ -229,25 +322,12 @@ namespace trie {
     ////////////////////////////
 
 
-    inline static NodePtr _growTypeSWith(MemoryPool_t *mem, TrieNodeS_t *cNode, NodePtr parent, const uint8_t pb, const uint8_t cb, NodePtr nextNode) {
-        auto newNode = _newTrieNodeM(mem).M;
-
-        newNode->Valid = cNode->Valid;
-        newNode->DtM.Size = TYPE_S_MAX+1;
-
-        for (size_t cidx=0; cidx<TYPE_S_MAX; ++cidx) {
-            newNode->DtM.Children()[cidx] = cNode->DtS.Children()[cidx];
-            newNode->DtM.ChildrenIndex[cidx] = cNode->DtS.ChildrenIndex[cidx];
-        }
-
-        auto childNode = nextNode;
-        newNode->DtM.ChildrenIndex[TYPE_S_MAX] = cb;
-        newNode->DtM.Children()[TYPE_S_MAX] = childNode;
-
-        switch(parent.S->Type) {
+    // Points the child of parent under byte pb to newNode (the node it replaces is left in the pool)
+    inline static void _replaceChild(NodePtr parent, const uint8_t pb, NodePtr newNode) {
+        switch(parent.Type()) {
         case NodeType::S:
         {
-            auto sp = parent.S;
+            auto sp = parent.S();
             for (size_t cidx=0; cidx<sp->DtS.Size; ++cidx) {
                 if (sp->DtS.ChildrenIndex[cidx] == pb) {
                     sp->DtS.Children()[cidx] = newNode;
@@ -258,7 +338,7 @@ namespace trie {
         }
         case NodeType::M:
         {
-            auto sp = parent.M;
+            auto sp = parent.M();
             for (size_t cidx=0; cidx<sp->DtM.Size; ++cidx) {
                 if (sp->DtM.ChildrenIndex[cidx] == pb) {
                     sp->DtM.Children()[cidx] = newNode;
@@ -267,66 +347,87 @@ namespace trie {
             }
             break;
         }
+        case NodeType::W:
+        {
+            auto sp = parent.W();
+            for (size_t cidx=0; cidx<sp->DtW.Size; ++cidx) {
+                if (sp->DtW.ChildrenIndex[cidx] == pb) {
+                    sp->DtW.Children()[cidx] = newNode;
+                    break;
+                }
+            }
+            break;
+        }
         case NodeType::L:
-            parent.L->DtL.Children[pb] = newNode;
+            parent.L()->DtL.Children[pb] = newNode;
             break;
         default:
             abort();
         }
+    }
+
+    inline static NodePtr _growTypeSWith(MemoryPool_t *mem, TrieNodeS_t *cNode, NodePtr parent, const uint8_t pb, const uint8_t cb, NodePtr nextNode) {
+        auto newNode = _newTrieNodeM(mem).M();
+
+        newNode->Valid = cNode->Valid;
+        newNode->DtM.Size = TYPE_S_MAX+1;
+
+        for (size_t cidx=0; cidx<TYPE_S_MAX; ++cidx) {
+            newNode->DtM.Children()[cidx] = cNode->DtS.Children()[cidx];
+            newNode->DtM.ChildrenIndex[cidx] = cNode->DtS.ChildrenIndex[cidx];
+        }
+
+        auto childNode = nextNode;
+        newNode->DtM.ChildrenIndex[TYPE_S_MAX] = cb;
+        newNode->DtM.Children()[TYPE_S_MAX] = childNode;
+
+        _replaceChild(parent, pb, newNode);
         return childNode;
     }
     inline static NodePtr _growTypeMWith(MemoryPool_t *mem, TrieNodeM_t *cNode, NodePtr parent, const uint8_t pb, const uint8_t cb, NodePtr nextNode) {
-        auto newNode = _newTrieNodeL(mem).L;
+        auto newNode = _newTrieNodeW(mem).W();
 
         newNode->Valid = cNode->Valid;
+        newNode->DtW.Size = TYPE_M_MAX+1;
+
         for (size_t cidx=0; cidx<TYPE_M_MAX; ++cidx) {
-            newNode->DtL.Children[cNode->DtM.ChildrenIndex[cidx]] = cNode->DtM.Children()[cidx];
+            newNode->DtW.Children()[cidx] = cNode->DtM.Children()[cidx];
+            newNode->DtW.ChildrenIndex[cidx] = cNode->DtM.ChildrenIndex[cidx];
+        }
+
+        auto childNode = nextNode;
+        newNode->DtW.ChildrenIndex[TYPE_M_MAX] = cb;
+        newNode->DtW.Children()[TYPE_M_MAX] = childNode;
+
+        _replaceChild(parent, pb, newNode);
+        return childNode;
+    }
+    inline static NodePtr _growTypeWWith(MemoryPool_t *mem, TrieNodeW_t *cNode, NodePtr parent, const uint8_t pb, const uint8_t cb, NodePtr nextNode) {
+        auto newNode = _newTrieNodeL(mem).L();
+
+        newNode->Valid = cNode->Valid;
+        for (size_t cidx=0; cidx<TYPE_W_MAX; ++cidx) {
+            newNode->DtL.Children[cNode->DtW.ChildrenIndex[cidx]] = cNode->DtW.Children()[cidx];
         }
         auto childNode = nextNode;
         newNode->DtL.Children[cb] = childNode;
 
         // Update the parent
-        switch(parent.M->Type) {
-        case NodeType::S:
-        {
-            auto sp = parent.S;
-            for (size_t cidx=0; cidx<sp->DtS.Size; ++cidx) {
-                if (sp->DtS.ChildrenIndex[cidx] == pb) {
-                    sp->DtS.Children()[cidx] = newNode;
-                    break;
-                }
-            }
-            break;
-        }
-        case NodeType::M:
-        {
-            auto sp = parent.M;
-            for (size_t cidx=0; cidx<sp->DtM.Size; ++cidx) {
-                if (sp->DtM.ChildrenIndex[cidx] == pb) {
-                    sp->DtM.Children()[cidx] = newNode;
-                    break;
-                }
-            }
-            break;
-        }
-        case NodeType::L:
-            parent.L->DtL.Children[pb] = newNode;
-            break;
-        default:
-            abort();
-        }
+        _replaceChild(parent, pb, newNode);
         return childNode;
     }
 
     // TODO create special version of the Add that does not require the parent details since most of the time
     // TODO we know that we will not grow since it is new nodes being added!!!
+    // The per-type add and search are template arguments of the walks below, so each walk is
+    // instantiated once per node type with them inlined instead of called through a pointer.
     typedef NodePtr(*AddFunc_t)(NodePtr, const uint8_t, NodePtr, const uint8_t, NodePtr, MemoryPool_t*);
     typedef NodePtr(*SearchFunc_t)(NodePtr, const uint8_t);
 
     // It might change the *cNode if this node needs to grow to accommodate the new node.
     // @return the added node - nextNode
-    static inline NodePtr _doSingleByteAddS(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
-        const auto sNode = cNode.S;
+    static ALWAYS_INLINE NodePtr _doSingleByteAddS(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
+        const auto sNode = cNode.S();
         const auto childrenIndex = sNode->DtS.ChildrenIndex;
         const size_t csz = sNode->DtS.Size;
         size_t cidx = 0;
@@ -347,8 +448,8 @@ namespace trie {
         }
         return nullptr;
     }
-    static inline NodePtr _doSingleByteSearchS(NodePtr cNode, const uint8_t cb) {
-        const auto sNode = cNode.S;
+    static ALWAYS_INLINE NodePtr _doSingleByteSearchS(NodePtr cNode, const uint8_t cb) {
+        const auto sNode = cNode.S();
         const auto childrenIndex = sNode->DtS.ChildrenIndex;
         const size_t csz = sNode->DtS.Size;
         size_t cidx = 0;
@@ -363,11 +464,11 @@ namespace trie {
     }
     // It might change the *cNode if this node needs to grow to accommodate the new node.
     // @return the added node - nextNode
-    static inline NodePtr _doSingleByteAddM(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
-        const auto mNode = cNode.M;
+    static ALWAYS_INLINE NodePtr _doSingleByteAddM(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
+        const auto mNode = cNode.M();
         const size_t csz = mNode->DtM.Size;
         auto key =_mm_set1_epi8(cb);
-        auto cmp =_mm_cmpeq_epi8(key, *(__m128i*)mNode->DtM.ChildrenIndex);
+        auto cmp =_mm_cmpeq_epi8(key, _mm_loadu_si128((const __m128i*)mNode->DtM.ChildrenIndex));
         auto mask=(1<<csz)-1;
         auto bitfield=_mm_movemask_epi8(cmp)&mask;
 
@@ -403,12 +504,12 @@ namespace trie {
 
         return nullptr;
     }
-    static inline NodePtr _doSingleByteSearchM(NodePtr cNode, const uint8_t cb) {
-        const auto mNode = cNode.M;
+    static ALWAYS_INLINE NodePtr _doSingleByteSearchM(NodePtr cNode, const uint8_t cb) {
+        const auto mNode = cNode.M();
         const size_t csz = mNode->DtM.Size;
 
         auto key =_mm_set1_epi8(cb);
-        auto cmp =_mm_cmpeq_epi8(key, *(__m128i*)mNode->DtM.ChildrenIndex);
+        auto cmp =_mm_cmpeq_epi8(key, _mm_loadu_si128((const __m128i*)mNode->DtM.ChildrenIndex));
         auto mask=(1<<csz)-1;
         auto bitfield=_mm_movemask_epi8(cmp)&mask;
         if (!bitfield) {
@@ -416,38 +517,88 @@ namespace trie {
         }
         return mNode->DtM.Children()[__builtin_ctz(bitfield)];
     }
+    // The keys of a W node equal to cb, as a bitmask with bit i for key i.
+    // The AVX2 kernel is inlined when the build targets AVX2 and otherwise picked by cy::cpu at runtime.
+    __attribute__((target("avx2"))) static inline uint32_t _keysEqualAvx2(const uint8_t *keys, const uint8_t cb) {
+        const __m256i cmp = _mm256_cmpeq_epi8(_mm256_set1_epi8(cb), _mm256_loadu_si256((const __m256i*)keys));
+        return _mm256_movemask_epi8(cmp);
+    }
+    static inline uint32_t _keysEqualSse2(const uint8_t *keys, const uint8_t cb) {
+        const __m128i key = _mm_set1_epi8(cb);
+        const uint32_t lo = _mm_movemask_epi8(_mm_cmpeq_epi8(key, _mm_loadu_si128((const __m128i*)keys)));
+        const uint32_t hi = _mm_movemask_epi8(_mm_cmpeq_epi8(key, _mm_loadu_si128((const __m128i*)(keys+16))));
+        return lo | (hi << 16);
+    }
+    static ALWAYS_INLINE uint32_t _keysEqualW(const uint8_t *keys, const uint8_t cb) {
+#ifdef __AVX2__
+        return _keysEqualAvx2(keys, cb);
+#else
+        return cy::cpu::Has(cy::cpu::Level_t::AVX2) ? _keysEqualAvx2(keys, cb) : _keysEqualSse2(keys, cb);
+#endif
+    }
+
+    // It might change the *cNode if this node needs to grow to accommodate the new node.
+    // @return the added node - nextNode
+    static ALWAYS_INLINE NodePtr _doSingleByteAddW(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
+        const auto wNode = cNode.W();
+        const size_t csz = wNode->DtW.Size;
+        const uint32_t bitfield = _keysEqualW(wNode->DtW.ChildrenIndex, cb) & (uint32_t)((1ULL<<csz)-1);
+        if (!bitfield) {
+            if (csz == TYPE_W_MAX) {
+                return _growTypeWWith(mem, wNode, parent, pb, cb, nextNode);
+            } else {
+                wNode->DtW.Children()[wNode->DtW.Size++] = nextNode;
+                wNode->DtW.ChildrenIndex[csz] = cb;
+                return nextNode;
+            }
+        } else {
+            return wNode->DtW.Children()[__builtin_ctz(bitfield)];
+        }
+
+        return nullptr;
+    }
+    static ALWAYS_INLINE NodePtr _doSingleByteSearchW(NodePtr cNode, const uint8_t cb) {
+        const auto wNode = cNode.W();
+        const size_t csz = wNode->DtW.Size;
+        const uint32_t bitfield = _keysEqualW(wNode->DtW.ChildrenIndex, cb) & (uint32_t)((1ULL<<csz)-1);
+        if (!bitfield) {
+            return nullptr;
+        }
+        return wNode->DtW.Children()[__builtin_ctz(bitfield)];
+    }
     // It might change the *cNode if this node needs to grow to accommodate the new node.
     // @return the added node - nextNode
-    static inline NodePtr _doSingleByteAddL(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
+    static ALWAYS_INLINE NodePtr _doSingleByteAddL(NodePtr cNode, const uint8_t cb, NodePtr nextNode, const uint8_t pb, NodePtr parent, MemoryPool_t *mem) {
         (void)pb; (void)parent; (void)mem;
-        cNode.L->DtL.Children[cb] = nextNode;
+        cNode.L()->DtL.Children[cb] = nextNode;
         return nextNode;
     }
-    static inline NodePtr _doSingleByteSearchL(NodePtr cNode, const uint8_t cb) {
-        return cNode.L->DtL.Children[cb];
+    static ALWAYS_INLINE NodePtr _doSingleByteSearchL(NodePtr cNode, const uint8_t cb) {
+        return cNode.L()->DtL.Children[cb];
     }
 
-    static inline NodePtr _doAddString(MemoryPool_t *mem, NodePtr cuNode, const uint8_t*bs, const size_t bsz, const size_t bidx, NodePtr parent, bool *done, AddFunc_t _doSingleByteAdd, SearchFunc_t _doSingleByteSearch) {
+    template<AddFunc_t _doSingleByteAdd, SearchFunc_t _doSingleByteSearch>
+    static ALWAYS_INLINE NodePtr _doAddString(MemoryPool_t *mem, NodePtr cuNode, const uint8_t*bs, const size_t bsz, const size_t bidx, NodePtr parent, bool *done) {
         const uint8_t cb = bs[bidx];
         const uint8_t pb = bidx > 0 ? bs[bidx-1] : 0;
 
         // The type we use here SHOULD NOT MATTER since this is just for accessing common
         // fields like Suffix and Valid and Type.
-        auto cNode = cuNode.S;
+        auto cNode = cuNode.S();
 
         if (cNode->Suffix.empty()) { // We just need to check children
             NodePtr nextNode = _doSingleByteSearch(cNode, cb); // Generic call
             if (!nextNode) {
                 nextNode = _newTrieNode(mem);
                 if (bidx+1 < bsz) { // this is NOT the last byte so add the remaining as suffix
-                    nextNode.L->Suffix = std::move(std::string(bs+bidx+1, bs+bsz));
+                    nextNode.L()->Suffix = std::move(std::string(bs+bidx+1, bs+bsz));
                     *done = true;
                 }
                 _doSingleByteAdd(cuNode, cb, nextNode, pb, parent, mem); // Generic call
             }
             // If this is the last byte of the ngram mark its node as valid
             if (bidx+1 == bsz) {
-                nextNode.L->Valid = true;
+                nextNode.L()->Valid = true;
                 *done = true;
             }
             return nextNode;
@@ -462,22 +613,22 @@ namespace trie {
         if (common == sufsz) { // the new ngram matched the whole existing suffix
             if (common == bsz-bidx) { // we are already at the proper node - don't do anything
                 *done = true;
-                return cNode;
+                return cuNode;
             }
             // there is some part of the new ngram to be added so we need to create the nodes
             // to cover the common bytes and then we will add as suffix the remaining part of the new ngram
 
             // Check if there is a common > 0 and then do the 1st child using the generic Add given as parameter
             // then in the for loop use the type S add since all the others are new nodes.
-            NodePtr nextNode = cNode;
+            NodePtr nextNode = cuNode;
             if (common > 0) {
                 nextNode = _doSingleByteAdd(nextNode, sufbs[0], _newTrieNode(mem), pb, parent, mem); // Generic call
             }
             for (size_t sidx=1; sidx<common; ++sidx) {
                 nextNode = _doSingleByteAddS(nextNode, sufbs[sidx], _newTrieNode(mem), pb, parent, mem);
             }
-            nextNode.S->Valid = true; // this is for the existing ngram
-            nextNode.S->Suffix = std::move(std::string((char*)bs+bidx+common, (char*)bs+bsz)); // the new ngram
+            nextNode.S()->Valid = true; // this is for the existing ngram
+            nextNode.S()->Suffix = std::move(std::string((char*)bs+bidx+common, (char*)bs+bsz)); // the new ngram
 
             cNode->Suffix = ""; // reset the cNode suffix since now its suffix became normal nodes
             *done = true;
@@ -490,7 +641,7 @@ namespace trie {
 
         // Check if there is a common > 0 and then do the 1st child using the generic Add given as parameter
         // then in the for loop use the type S add since all the others are new nodes.
-        NodePtr nextNode = cNode;
+        NodePtr nextNode = cuNode;
         if (common > 0) {
             nextNode = _doSingleByteAdd(nextNode, sufbs[0], _newTrieNode(mem), pb, parent, mem); // Generic call
         }
@@ -506,9 +657,9 @@ namespace trie {
         }
         if (common+1 == sufsz) {
             // there was only 1 byte remaining and it was added through a new node.
-            newNode.S->Valid = true;
+            newNode.S()->Valid = true;
         } else {
-            newNode.S->Suffix = std::move(suffix.substr(common+1));
+            newNode.S()->Suffix = std::move(suffix.substr(common+1));
         }
 
         // add the remaining of the new ngram
@@ -520,14 +671,14 @@ namespace trie {
             }
             if (bidx+common+1 == bsz) {
                 // there was only 1 byte remaining and it was added through a new node.
-                newNode.S->Valid = true;
+                newNode.S()->Valid = true;
             } else {
-                newNode.S->Suffix =std::move(std::string((char*)bs+bidx+common+1, (char*)bs+bsz));
+                newNode.S()->Suffix =std::move(std::string((char*)bs+bidx+common+1, (char*)bs+bsz));
             }
             nextNode = newNode;
         } else {
             // the common was the whole new ngram
-            nextNode.S->Valid = true;
+            nextNode.S()->Valid = true;
         }
 
         cNode->Suffix = ""; // reset the cNode suffix since now its suffix became normal nodes
@@ -535,56 +686,122 @@ namespace trie {
         return nextNode;
     }
 
+    static inline NodePtr _doSingleByteSearch(NodePtr cNode, const uint8_t cb) {
+        switch(cNode.Type()) {
+            case NodeType::S: return _doSingleByteSearchS(cNode, cb);
+            case NodeType::M: return _doSingleByteSearchM(cNode, cb);
+            case NodeType::W: return _doSingleByteSearchW(cNode, cb);
+            case NodeType::L: return _doSingleByteSearchL(cNode, cb);
+            default: abort();
+        }
+        return nullptr;
+    }
+
+    // The insertion path of the previous ngram so that the next one resumes at their
+    // longest common prefix instead of walking again from the root.
+    // Path[d] is the node reached after the first d bytes of Prev (Path[0] is the root).
+    struct InsertCursor_t {
+        std::vector<NodePtr> Path;
+        std::string Prev;
+    };
+
+    // Replaces the suffix leaf cNode (child of parent under pb) by an X node holding its ngrams
+    static inline NodePtr _convertLeafToX(MemoryPool_t *mem, NodePtr cNode, NodePtr parent, const uint8_t pb) {
+        auto xNode = _newTrieNodeX(mem).X();
+        auto& suffix = cNode.S()->Suffix;
+        xNode->Valid = cNode.S()->Valid;
+        xNode->Tails.insert(StrView_t(mem->_newTail(suffix.data(), suffix.size()), suffix.size()));
+        xNode->MaxLen = suffix.size();
+        std::string().swap(suffix);
+        _replaceChild(parent, pb, xNode);
+        return xNode;
+    }
+
+    // Any ngram order is correct but lexicographically sorted ngrams reuse the most of the path.
     // @param s The whole ngram
-    static void AddString(MemoryPool_t *mem, NodePtr cNode, const std::string& s) {
+    // @param xDepth Suffix leaves at this depth or deeper become X nodes when split (with USE_TYPE_X)
+    static void AddString(MemoryPool_t *mem, InsertCursor_t *cursor, const std::string& s, const size_t xDepth) {
+        (void)xDepth;
         const size_t bsz = s.size();
         const uint8_t* bs = reinterpret_cast<const uint8_t*>(s.data());
+        auto& path = cursor->Path;
+        if (!bsz) { return; }
+
+        // The last byte is always processed from its parent node since that is where it gets marked valid
+        const auto& prev = cursor->Prev;
+        size_t lcp = 0;
+        for (const size_t psz = std::min(prev.size(), bsz-1); lcp < psz && prev[lcp] == s[lcp];) { ++lcp; }
+        size_t bidx = std::min(lcp, path.size()-1);
+        path.resize(bidx+1);
+        cursor->Prev = s;
+
         bool done = false;
-        NodePtr parent = (TrieNodeS_t*)nullptr;
-        NodePtr previous = (TrieNodeS_t*)nullptr;
-        for (size_t bidx = 0; bidx < bsz; bidx++) {
-            previous = cNode;
+        NodePtr cNode = path[bidx];
+        NodePtr parent = bidx > 0 ? path[bidx-1] : NodePtr((TrieNodeS_t*)nullptr);
+        for (; bidx < bsz; bidx++) {
+#ifdef USE_TYPE_X
+            if (bidx >= xDepth && !cNode.S()->Suffix.empty()) {
+                cNode = _convertLeafToX(mem, cNode, parent, bs[bidx-1]);
+                path[bidx] = cNode;
+            }
+#endif
+            // Leaves get children when they are split but never grow, so only an inner node
+            // can be replaced in its parent by a bigger one while we add below it.
+            const bool wasLeaf = !cNode.S()->Suffix.empty();
+            const NodePtr current = cNode;
 
-            switch(cNode.L->Type) {
+            switch(cNode.Type()) {
                 case NodeType::S:
                     {
-                        cNode = _doAddString(mem, cNode, bs, bsz, bidx, parent, &done, _doSingleByteAddS, _doSingleByteSearchS);
+                        cNode = _doAddString<_doSingleByteAddS, _doSingleByteSearchS>(mem, cNode, bs, bsz, bidx, parent, &done);
                         break;
                     }
                 case NodeType::M:
                     {
-                        cNode = _doAddString(mem, cNode, bs, bsz, bidx, parent, &done, _doSingleByteAddM, _doSingleByteSearchM);
+                        cNode = _doAddString<_doSingleByteAddM, _doSingleByteSearchM>(mem, cNode, bs, bsz, bidx, parent, &done);
+                        break;
+                    }
+                case NodeType::W:
+                    {
+                        cNode = _doAddString<_doSingleByteAddW, _doSingleByteSearchW>(mem, cNode, bs, bsz, bidx, parent, &done);
                         break;
                     }
                 case NodeType::L:
                     {
-                        cNode = _doAddString(mem, cNode, bs, bsz, bidx, parent, &done, _doSingleByteAddL, _doSingleByteSearchL);
+                        cNode = _doAddString<_doSingleByteAddL, _doSingleByteSearchL>(mem, cNode, bs, bsz, bidx, parent, &done);
                         break;
                     }
                 case NodeType::X:
                     {
-                        const auto xNode = cNode.X;
-                        const std::string key(s.substr(bidx));
-                        auto it = xNode->ChildrenMap.find(key);
-                        if (it == xNode->ChildrenMap.end()) {
-                            it = xNode->ChildrenMap.insert(it, {std::move(key), _newTrieNode(mem)});
+                        const auto xNode = cNode.X();
+                        const StrView_t tail(s.data()+bidx, bsz-bidx);
+                        if (xNode->Tails.find(tail) == xNode->Tails.end()) {
+                            xNode->Tails.insert(StrView_t(mem->_newTail(tail.Data, tail.Size), tail.Size));
+                            xNode->MaxLen = std::max(xNode->MaxLen, tail.Size);
                         }
                         done = true;
                         break;
-                        abort();
                     }
                 default:
                     abort();
             }
-            if (done) { return; }
+            if (done) {
+                if (!wasLeaf && current.Type() != NodeType::X) {
+                    if (bidx > 0) { path[bidx] = _doSingleByteSearch(parent, bs[bidx-1]); }
+                    path.push_back(cNode);
+                }
+                return;
+            }
 
-            parent = previous;
+            path.push_back(cNode);
+            parent = current;
         }
     }
 
-    static inline NodePtr _doDelString(NodePtr cuNode, const uint8_t*bs, const size_t bsz, const size_t bidx, bool *done, SearchFunc_t _doSingleByteSearch) {
+    template<SearchFunc_t _doSingleByteSearch>
+    static ALWAYS_INLINE NodePtr _doDelString(NodePtr cuNode, const uint8_t*bs, const size_t bsz, const size_t bidx, bool *done) {
         const uint8_t cb = bs[bidx];
-        const auto cNode = cuNode.S; // SHOULD NOT MATTER which type I take!!!
+        const auto cNode = cuNode.S(); // SHOULD NOT MATTER which type I take!!!
 
         if (cNode->Suffix.empty()) { // NOT LEAF
             NodePtr nextNode = _doSingleByteSearch(cNode, cb);
@@ -593,7 +810,7 @@ namespace trie {
                 return nullptr;
             }
             if (bidx+1 == bsz) {
-                nextNode.S->Valid = false; // make the delete
+                nextNode.S()->Valid = false; // make the delete
                 *done = true;
             }
             return nextNode;
@@ -628,28 +845,31 @@ namespace trie {
         bool done = false;
 
         for (size_t bidx = 0; bidx < bsz; bidx++) {
-            switch(cNode.L->Type) {
+            switch(cNode.Type()) {
                 case NodeType::S:
                     {
-                        cNode = _doDelString(cNode, bs, bsz, bidx, &done, _doSingleByteSearchS);
+                        cNode = _doDelString<_doSingleByteSearchS>(cNode, bs, bsz, bidx, &done);
                         break;
                     }
                 case NodeType::M:
                     {
-                        cNode = _doDelString(cNode, bs, bsz, bidx, &done, _doSingleByteSearchM);
+                        cNode = _doDelString<_doSingleByteSearchM>(cNode, bs, bsz, bidx, &done);
+                        break;
+                    }
+                case NodeType::W:
+                    {
+                        cNode = _doDelString<_doSingleByteSearchW>(cNode, bs, bsz, bidx, &done);
                         break;
                     }
                 case NodeType::L:
                     {
-                        cNode = _doDelString(cNode, bs, bsz, bidx, &done, _doSingleByteSearchL);
+                        cNode = _doDelString<_doSingleByteSearchL>(cNode, bs, bsz, bidx, &done);
                         break;
                     }
                 case NodeType::X:
                     {
-                        const auto xNode = cNode.X;
-                        const std::string key(s.substr(bidx));
-                        const auto it = xNode->ChildrenMap.find(key);
-                        if (it == xNode->ChildrenMap.end()) { return; }
+                        // the tail bytes stay in the arena
+                        cNode.X()->Tails.erase(StrView_t(s.data()+bidx, bsz-bidx));
                         done = true;
                         break;
                     }
@@ -662,72 +882,41 @@ namespace trie {
         return;
     }
 
-    inline static std::vector<std::pair<size_t, uint64_t>> _findAllTypeX(TrieNodeX_t *cNode, std::vector<std::pair<size_t,uint64_t>>& results, const char*s, size_t bidx, const size_t bsz) {
-
-        // 1. Find the next word
-        // 2. Fetch the range of ngrams matching that word (lower_bound/equal_range)
-        // 3. Examine all these ngrams to be prefix of the remaining doc (s)
-        // 4. Careful!!! if a full ngram ends in the middle of a doc word
+    // The tails of an X node matching the doc are whole words of it, so instead of scanning
+    // the tails each word end of the doc within MaxLen bytes is looked up.
+    // @return the number of bytes of s the results depend on (see FindAll)
+    inline static size_t _findAllTypeX(TrieNodeX_t *cNode, std::vector<std::pair<size_t,uint64_t>>& results, const char*s, size_t bidx, const size_t bsz) {
+        const auto& tails = cNode->Tails;
+        if (tails.empty()) { return bidx+1; }
 
         const uint8_t* bs = reinterpret_cast<const uint8_t*>(s);
-        size_t endOfWord = bidx;
-        // skip the inbetween spaces and then reach the end of the word (there is at least 1 space or 1 char)
-        for (; endOfWord < bsz && bs[endOfWord] == ' '; endOfWord++) {}
-        for (; endOfWord < bsz && bs[endOfWord] != ' '; endOfWord++) {}
-
-        const std::pair<const char*, const char*> firstWord{s+bidx, s+endOfWord};
-        const size_t firstWordSz = endOfWord-bidx;
-
-        auto& children = cNode->ChildrenMap;
-        auto lb = std::lower_bound(children.begin(), children.end(), firstWord,
-                [firstWordSz](const std::pair<std::string, NodePtr>& ngram, const std::pair<const char*, const char*>& firstWord) {
-                    return std::strncmp(ngram.first.c_str(), firstWord.first, firstWordSz) < 0;
-                });
-
-        if (lb == children.end()) {
-            //std::cerr << "No Match." << std::endl;
-            return std::move(results);
-        }
-
-        for (auto it=lb, end=children.end(); it != end; ++it) {
-            //std::cerr << "Matching...." << it->first << std::endl;
-            // We have to stop as soon as results are not prefixed with firstWord
-
-            if (std::strncmp(it->first.c_str(), firstWord.first, firstWordSz) != 0) {
-                break;
-            }
-
-            const auto& ngram = it->first;
-
-            // make sure doc can fit the ngram
-            if (ngram.size() > bsz-bidx) { continue; }
-            const size_t ngsz = ngram.size();
-            const uint8_t* cbs = bs+bidx;
-            const size_t cbssz = bsz-bidx;
-
-            // make sure that the ngram is not ending in the middle of a word
-            if (ngsz < cbssz && cbs[ngsz] != ' ') { continue; }
-
-            if ((std::strncmp(ngram.c_str()+firstWordSz, firstWord.first+firstWordSz, ngsz-firstWordSz) == 0) && it->second.S->Valid) {
-                results.emplace_back(bidx + ngsz, (uint64_t)it->second.L);
+        const size_t maxEnd = std::min(bsz, bidx + cNode->MaxLen);
+        for (size_t end = bidx+1; end <= maxEnd; ++end) {
+            if (end < bsz && bs[end] != ' ') { continue; }
+            const auto it = tails.find(StrView_t(s+bidx, end-bidx));
+            if (it != tails.end()) {
+                results.emplace_back(end, (uint64_t)it->Data);
             }
         }
-
-        return std::move(results);
+        // the byte after the longest tail decides if it ends at a word end
+        return maxEnd + 1;
     }
 
     // @return the pointer to the next node to visit or nullptr if we finished and need to return the results
-    static NodePtr _doFindAll(NodePtr cuNode, const uint8_t cb, const size_t bsz, const uint8_t *bs, const size_t bidx, std::vector<std::pair<size_t, uint64_t>>& results, SearchFunc_t _doSingleByteSearch) {
-        const auto cNode = cuNode.S; // SHOULD NOT MATTER WHAT TYPE YOU GET
+    template<SearchFunc_t _doSingleByteSearch>
+    static ALWAYS_INLINE NodePtr _doFindAll(NodePtr cuNode, const uint8_t cb, const size_t bsz, const uint8_t *bs, const size_t bidx, std::vector<std::pair<size_t, uint64_t>>& results, size_t *examined) {
+        const auto cNode = cuNode.S(); // SHOULD NOT MATTER WHAT TYPE YOU GET
         if (cNode->Suffix.empty()) {
             return _doSingleByteSearch(cNode, cb);
         } else {
             // the doc has to match the whole ngram suffix
             const auto suffix = reinterpret_cast<const uint8_t*>(cNode->Suffix.data());
             const auto sufsz = cNode->Suffix.size();
-            if (sufsz > bsz-bidx) { return nullptr; }
+            if (sufsz > bsz-bidx) { *examined = bsz+1; return nullptr; }
+            *examined = bidx + sufsz;
             if (std::memcmp(suffix, bs+bidx, sufsz) != 0) { return nullptr; }
             const size_t nbidx = bidx + sufsz;
+            *examined = nbidx + 1;
             if (nbidx >= bsz || bs[nbidx] == ' ') {
                 results.emplace_back(nbidx, (uint64_t)suffix);
             }
@@ -736,127 +925,264 @@ namespace trie {
     }
 
     // @param s The whole doc prefix that we need to find ALL NGRAMS matching
-    static std::vector<std::pair<size_t, uint64_t>> FindAll(NodePtr cNode, const char *s, const size_t docSize) {
+    // @param results Appended with the endPos of each valid ngram found in s and the identifier for the ngram (pointer for now).
+    // It is not cleared so that the caller can reuse its capacity across calls.
+    // @param examined Set to the number of bytes of s the results depend on. It is docSize+1 if they
+    // also depend on where s ends, otherwise any text starting with these bytes has the same results.
+    // @param maxBytes, maxWords No live ngram below cNode is longer, so the walk stops there
+    // @param pairs If given, the walk stops before a word that never follows the previous one in an ngram.
+    // It is only consulted where many words follow the space (not at S nodes, which reject the wrong
+    // next word within a byte or two anyway).
+    static void FindAll(NodePtr cNode, const char *s, const size_t docSize, std::vector<std::pair<size_t, uint64_t>>& results, size_t *examined,
+                        const size_t maxBytes = ~(size_t)0, const size_t maxWords = ~(size_t)0, const cy::pairs::PairFilter_t *pairs = nullptr) {
         const size_t bsz = docSize;
         const uint8_t* bs = reinterpret_cast<const uint8_t*>(s);
+        const size_t walkEnd = std::min(bsz, maxBytes);
+        size_t words = 1;
+        size_t wordStart = 0;
+        size_t hashedStart = ~(size_t)0; // the start of the word whose hash is in hashedWord
+        uint64_t hashedWord = 0;
 
-        // Holds the endPos for each valid ngram found in the given doc and the identifier for the ngram (pointer for now)
-        std::vector<std::pair<size_t, uint64_t>> results;
-
-        for (size_t bidx = 0; bidx < bsz; bidx++) {
+        for (size_t bidx = 0; bidx < walkEnd; bidx++) {
             const uint8_t cb = bs[bidx];
+            *examined = bidx+1;
 
-            switch(cNode.L->Type) {
+            switch(cNode.Type()) {
                 case NodeType::S:
                     {
-                        cNode = _doFindAll(cNode, cb, bsz, bs, bidx, results, _doSingleByteSearchS);
-                        if (!cNode) { return std::move(results); }
+                        cNode = _doFindAll<_doSingleByteSearchS>(cNode, cb, bsz, bs, bidx, results, examined);
+                        if (!cNode) { return; }
                         break;
                     }
                 case NodeType::M:
                     {
-                        cNode = _doFindAll(cNode, cb, bsz, bs, bidx, results, _doSingleByteSearchM);
-                        if (!cNode) { return std::move(results); }
+                        cNode = _doFindAll<_doSingleByteSearchM>(cNode, cb, bsz, bs, bidx, results, examined);
+                        if (!cNode) { return; }
+                        break;
+                    }
+                case NodeType::W:
+                    {
+                        cNode = _doFindAll<_doSingleByteSearchW>(cNode, cb, bsz, bs, bidx, results, examined);
+                        if (!cNode) { return; }
                         break;
                     }
                 case NodeType::L:
                     {
-                        cNode = _doFindAll(cNode, cb, bsz, bs, bidx, results, _doSingleByteSearchL);
-                        if (!cNode) { return std::move(results); }
+                        cNode = _doFindAll<_doSingleByteSearchL>(cNode, cb, bsz, bs, bidx, results, examined);
+                        if (!cNode) { return; }
                         break;
                     }
                 case NodeType::X:
                     {
-                        return _findAllTypeX(cNode.X, results, s, bidx, bsz);
-                        abort();
+                        *examined = _findAllTypeX(cNode.X(), results, s, bidx, bsz);
+                        return;
                     }
                 default:
                     abort();
             } // end of switch
 
+            if (cb == ' ' && pairs) {
+                if (cNode.Type() != NodeType::S) {
+                    const uint64_t wordHash = hashedStart == wordStart ? hashedWord : cy::pairs::WordHash(s+wordStart, bidx-wordStart);
+                    size_t nextEnd = bidx+1;
+                    while (nextEnd < bsz && bs[nextEnd] != ' ') { ++nextEnd; }
+                    hashedWord = cy::pairs::WordHash(s+bidx+1, nextEnd-bidx-1);
+                    hashedStart = bidx+1;
+                    if (!pairs->MayContain(wordHash, hashedWord)) {
+                        *examined = nextEnd+1;
+                        return;
+                    }
+                }
+                wordStart = bidx+1;
+            }
+
             // For Types S,M,L
             // at the end of each word check if the ngram so far is a valid result
-            if (bs[bidx+1] == ' ' && cNode.L->Valid) {
-                results.emplace_back(bidx+1, (uint64_t)cNode.L);
+            *examined = bidx+2;
+            if (bs[bidx+1] == ' ') {
+                if (cNode.L()->Valid) { results.emplace_back(bidx+1, (uint64_t)cNode.L()); }
+                if (++words > maxWords) { return; }
             }
         }
+        if (walkEnd < bsz) { return; } // the longest ngram ended at walkEnd and was checked above
 
         // For Types S,M,L
         // We are here it means the whole doc matched the ngram ending at cNode
-        //if (cNode && cNode.L->State.IsValid(opIdx)) {
-        if (cNode && cNode.L->Valid) {
-            results.emplace_back(bsz, (uint64_t)cNode.L);
+        *examined = bsz+1;
+        //if (cNode && cNode.L()->State.IsValid(opIdx)) {
+        if (cNode && cNode.L()->Valid) {
+            results.emplace_back(bsz, (uint64_t)cNode.L());
         }
+    }
+
 
-        return std::move(results);
+    // Histograms with power of 2 buckets: [0], [1], [2,3], [4,7], ...
+    constexpr size_t STATS_LOG_BUCKETS = 24;
+    static inline size_t _logBucket(size_t v) {
+        return std::min<size_t>(v ? 64 - __builtin_clzll(v) : 0, STATS_LOG_BUCKETS-1);
     }
 
+    // On-demand statistics of a trie, collected by walking it (the trie must not change meanwhile).
+    struct TrieStats_t {
+        struct PoolStats_t {
+            size_t NodeBytes;
+            size_t Used;      // nodes handed out by the pool (including the ones replaced by a grow or moved to another trie)
+            size_t Allocated; // nodes in all the allocated blocks
+            PoolStats_t() : NodeBytes(0), Used(0), Allocated(0) {}
+        };
 
-    size_t GrowsM = 0, GrowsL = 0;
-    size_t NumberOfNodes = 0;
-    size_t xChMin = 999999, xChMax = 0, xChTotal = 0, xTotal = 0, xCh0 = 0;
-    static void _takeAnalytics(NodePtr cNode) {
-        NumberOfNodes++;
-        switch(cNode.S->Type) {
+        size_t Nodes[NUM_NODE_TYPES]; // reachable nodes per NodeType
+        size_t Leaves;      // nodes with a suffix
+        size_t DeadNodes;   // invalid nodes without children or suffix (left behind by deletes)
+        size_t Ngrams;      // valid ngrams
+        size_t SuffixBytes; // heap bytes of the suffixes not fitting in the string object and of the X node tails
+        std::vector<size_t> Fanout; // Fanout[c] nodes with c children
+        std::vector<size_t> SuffixLength;
+        std::vector<size_t> Depth;
+        PoolStats_t Pool[NUM_NODE_TYPES];
+
+        TrieStats_t() : Nodes{0,0,0,0,0}, Leaves(0), DeadNodes(0), Ngrams(0), SuffixBytes(0),
+            Fanout(TYPE_L_MAX+1, 0), SuffixLength(STATS_LOG_BUCKETS, 0), Depth(STATS_LOG_BUCKETS, 0) {}
+
+        void Merge(const TrieStats_t& o) {
+            for (size_t t=0; t<NUM_NODE_TYPES; ++t) {
+                Nodes[t] += o.Nodes[t];
+                Pool[t].NodeBytes = o.Pool[t].NodeBytes;
+                Pool[t].Used += o.Pool[t].Used;
+                Pool[t].Allocated += o.Pool[t].Allocated;
+            }
+            Leaves += o.Leaves; DeadNodes += o.DeadNodes; Ngrams += o.Ngrams; SuffixBytes += o.SuffixBytes;
+            for (size_t i=0; i<Fanout.size(); ++i) { Fanout[i] += o.Fanout[i]; }
+            for (size_t i=0; i<STATS_LOG_BUCKETS; ++i) {
+                SuffixLength[i] += o.SuffixLength[i];
+                Depth[i] += o.Depth[i];
+            }
+        }
+
+        static void _printLogHistogram(std::ostream& out, const std::vector<size_t>& h) {
+            for (size_t i=0; i<h.size(); ++i) {
+                if (h[i]) { out << " <" << (1ULL<<i) << ":" << h[i]; }
+            }
+        }
+
+        void Print(std::ostream& out, const std::string& prefix) const {
+            static const char* types[NUM_NODE_TYPES] = {"S", "M", "L", "X", "W"};
+            out << prefix << " nodes";
+            for (size_t t=0; t<NUM_NODE_TYPES; ++t) { out << " " << types[t] << ":" << Nodes[t]; }
+            out << " leaves:" << Leaves << " dead:" << DeadNodes << " ngrams:" << Ngrams << " suffixBytes:" << SuffixBytes << "\n";
+
+            out << prefix << " fanout";
+            for (size_t c=0; c<Fanout.size(); ++c) {
+                if (Fanout[c]) { out << " " << c << ":" << Fanout[c]; }
+            }
+            out << "\n" << prefix << " suffixLength"; _printLogHistogram(out, SuffixLength);
+            out << "\n" << prefix << " depth"; _printLogHistogram(out, Depth);
+
+            out << "\n" << prefix << " pool";
+            for (size_t t=0; t<NUM_NODE_TYPES; ++t) {
+                const auto& p = Pool[t];
+                out << " " << types[t] << ":" << p.Used*p.NodeBytes << "/" << p.Allocated*p.NodeBytes;
+            }
+            out << " (bytes used/allocated)\n";
+        }
+    };
+
+    static void _collectStats(NodePtr cNode, const size_t depth, TrieStats_t *stats) {
+        const auto node = cNode.S(); // common fields only
+        size_t children = 0;
+        stats->Nodes[(size_t)node->Type]++;
+        stats->Depth[_logBucket(depth)]++;
+        switch(node->Type) {
             case NodeType::S:
                 {
-                    auto sNode = cNode.S;
-                    const size_t csz = sNode->DtS.Size;
-                    for (size_t cidx = 0; cidx<csz; cidx++) {
-                        _takeAnalytics(sNode->DtS.Children()[cidx]);
+                    auto sNode = cNode.S();
+                    children = sNode->DtS.Size;
+                    for (size_t cidx = 0; cidx<children; cidx++) {
+                        _collectStats(sNode->DtS.Children()[cidx], depth+1, stats);
                     }
                     break;
                 }
             case NodeType::M:
                 {
-                    GrowsM++;
-                    auto mNode = cNode.M;
-                    const size_t csz = mNode->DtM.Size;
-                    for (size_t cidx = 0; cidx<csz; cidx++) {
-                        _takeAnalytics(mNode->DtM.Children()[cidx]);
+                    auto mNode = cNode.M();
+                    children = mNode->DtM.Size;
+                    for (size_t cidx = 0; cidx<children; cidx++) {
+                        _collectStats(mNode->DtM.Children()[cidx], depth+1, stats);
+                    }
+                    break;
+                }
+            case NodeType::W:
+                {
+                    auto wNode = cNode.W();
+                    children = wNode->DtW.Size;
+                    for (size_t cidx = 0; cidx<children; cidx++) {
+                        _collectStats(wNode->DtW.Children()[cidx], depth+1, stats);
                     }
                     break;
                 }
             case NodeType::L:
                 {
-                    GrowsL++;
-                    const auto& children = cNode.L->DtL.Children;
+                    const auto& lchildren = cNode.L()->DtL.Children;
                     for (size_t cidx = 0; cidx<TYPE_L_MAX; cidx++) {
-                        if (children[cidx]) {
-                            _takeAnalytics(children[cidx]);
+                        if (lchildren[cidx]) {
+                            children++;
+                            _collectStats(lchildren[cidx], depth+1, stats);
                         }
                     }
                     break;
                 }
             case NodeType::X:
                 {
-                    xTotal++;
-                    const size_t chsz = cNode.X->ChildrenMap.size();
-                    xChTotal += chsz;
-                    if (chsz == 0) { xCh0++; }
-                    if (chsz < xChMin) { xChMin = chsz; }
-                    if (chsz > xChMax) { xChMax = chsz; }
-
-                    break;
+                    const auto& tails = cNode.X()->Tails;
+                    children = tails.size();
+                    stats->Ngrams += children;
+                    stats->Fanout[std::min(children, TYPE_L_MAX)]++;
+                    for (const auto& tail : tails) {
+                        stats->SuffixLength[_logBucket(tail.Size)]++;
+                        stats->SuffixBytes += tail.Size;
+                    }
+                    if (cNode.X()->Valid) { stats->Ngrams++; }
+                    return;
                 }
             default:
                 abort();
         }
+        stats->Fanout[children]++;
+
+        const auto& suffix = node->Suffix;
+        if (!suffix.empty()) {
+            stats->Leaves++;
+            stats->Ngrams++;
+            stats->SuffixLength[_logBucket(suffix.size())]++;
+            if (suffix.capacity() > 15) { stats->SuffixBytes += suffix.capacity() + 1; }
+        }
+        if (node->Valid) { stats->Ngrams++; }
+        if (!node->Valid && !children && suffix.empty()) { stats->DeadNodes++; }
     }
 
-
     bool printed = false;
     struct TrieRoot_t {
         NodePtr Root;
         MemoryPool_t MemoryPool;
+        InsertCursor_t Cursor;
+        size_t XDepth;
+
+        // The longest live ngram per first byte, in bytes and in words. Deletes only mark the byte
+        // stale since a larger bound is still safe, and RefreshBounds recomputes the stale ones.
+        uint32_t MaxBytes[256];
+        uint32_t MaxWords[256];
+        bool StaleBounds[256];
+
+        cy::pairs::PairFilter_t Pairs; // the consecutive words of the ngrams, rebuilt by RefreshPairs
 
-        TrieRoot_t() {
+        TrieRoot_t(const size_t blockS = MEMORY_POOL_BLOCK_SIZE_S) : MemoryPool(blockS), XDepth(TYPE_X_DEPTH), MaxBytes{}, MaxWords{}, StaleBounds{} {
             if (!printed) {
-            std::cerr << sizeof(TrieNodeS_t) << "::" << sizeof(TrieNodeM_t) <<  "::" << sizeof(TrieNodeL_t) <<  "::" << sizeof(TrieNodeX_t) << "::" << sizeof(DataS<2>) << "::" << sizeof(DataS<16>) << "::" << sizeof(NodePtr) << std::endl;
+            std::cerr << sizeof(TrieNodeS_t) << "::" << sizeof(TrieNodeM_t) <<  "::" << sizeof(TrieNodeW_t) <<  "::" << sizeof(TrieNodeL_t) <<  "::" << sizeof(TrieNodeX_t) << "::" << sizeof(DataS<2>) << "::" << sizeof(DataS<16>) << "::" << sizeof(NodePtr) << std::endl;
 
             std::cerr << "S" << TYPE_S_MAX << " L" << TYPE_L_MAX << " X" << TYPE_X_DEPTH;
             std::cerr << " MEM_S" << MEMORY_POOL_BLOCK_SIZE_S;
             std::cerr << " MEM_M" << MEMORY_POOL_BLOCK_SIZE_M;
+            std::cerr << " MEM_W" << MEMORY_POOL_BLOCK_SIZE_W;
             std::cerr << " MEM_L" << MEMORY_POOL_BLOCK_SIZE_L;
             std::cerr << " MEM_X" << MEMORY_POOL_BLOCK_SIZE_X;
             std::cerr << std::endl;
@@ -865,22 +1191,359 @@ namespace trie {
             }
             Root = _newTrieNodeL(&MemoryPool);
             if (!Root) { abort(); }
-        }
-        ~TrieRoot_t() {
-            _takeAnalytics(Root);
-            std::cerr << "growsM::" << GrowsM << " growsL::" << GrowsL << " #nodes::" << NumberOfNodes << std::endl;
-            //std::cerr << "MAP::" << xTotal << "::" << xCh0 << "::" << xChMin << "::" << xChMax << "::" << (xChTotal*1.0/xTotal) << std::endl;
+            Cursor.Path.reserve(256);
+            Cursor.Path.push_back(Root);
         }
     };
 
+    template<typename T>
+    static inline void _poolStats(const std::vector<T*>& blocks, const size_t allocated, const size_t blockSize, TrieStats_t::PoolStats_t *pool) {
+        pool->NodeBytes = sizeof(T);
+        pool->Allocated = blocks.size() * blockSize;
+        pool->Used = blocks.empty() ? 0 : (blocks.size()-1) * blockSize + allocated;
+    }
+
+    // The node counts are of the live trie, the pool counts also have the nodes it left behind
+    // (grown nodes, subtries MoveRootChild copied to another trie)
+    static void CollectStats(TrieRoot_t *trie, TrieStats_t *stats) {
+        _collectStats(trie->Root, 0, stats);
+        const auto& mem = trie->MemoryPool;
+        _poolStats(mem._mS, mem.allocatedS, mem.BlockS, &stats->Pool[(size_t)NodeType::S]);
+        _poolStats(mem._mM, mem.allocatedM, MEMORY_POOL_BLOCK_SIZE_M, &stats->Pool[(size_t)NodeType::M]);
+        _poolStats(mem._mW, mem.allocatedW, MEMORY_POOL_BLOCK_SIZE_W, &stats->Pool[(size_t)NodeType::W]);
+        _poolStats(mem._mL, mem.allocatedL, MEMORY_POOL_BLOCK_SIZE_L, &stats->Pool[(size_t)NodeType::L]);
+        _poolStats(mem._mX, mem.allocatedX, MEMORY_POOL_BLOCK_SIZE_X, &stats->Pool[(size_t)NodeType::X]);
+    }
+
+    template<typename F>
+    static void _forEachNgram(NodePtr cNode, std::string& prefix, F& f) {
+        const auto node = cNode.S(); // common fields only
+        if (node->Valid) { f(prefix); }
+        const size_t psz = prefix.size();
+        if (!node->Suffix.empty()) {
+            prefix.append(node->Suffix);
+            f(prefix);
+            prefix.resize(psz);
+        }
+        switch(node->Type) {
+            case NodeType::S:
+                for (size_t cidx = 0; cidx<cNode.S()->DtS.Size; cidx++) {
+                    prefix.push_back(cNode.S()->DtS.ChildrenIndex[cidx]);
+                    _forEachNgram(cNode.S()->DtS.Children()[cidx], prefix, f);
+                    prefix.resize(psz);
+                }
+                break;
+            case NodeType::M:
+                for (size_t cidx = 0; cidx<cNode.M()->DtM.Size; cidx++) {
+                    prefix.push_back(cNode.M()->DtM.ChildrenIndex[cidx]);
+                    _forEachNgram(cNode.M()->DtM.Children()[cidx], prefix, f);
+                    prefix.resize(psz);
+                }
+                break;
+            case NodeType::W:
+                for (size_t cidx = 0; cidx<cNode.W()->DtW.Size; cidx++) {
+                    prefix.push_back(cNode.W()->DtW.ChildrenIndex[cidx]);
+                    _forEachNgram(cNode.W()->DtW.Children()[cidx], prefix, f);
+                    prefix.resize(psz);
+                }
+                break;
+            case NodeType::L:
+                for (size_t cidx = 0; cidx<TYPE_L_MAX; cidx++) {
+                    if (!cNode.L()->DtL.Children[cidx]) { continue; }
+                    prefix.push_back(cidx);
+                    _forEachNgram(cNode.L()->DtL.Children[cidx], prefix, f);
+                    prefix.resize(psz);
+                }
+                break;
+            case NodeType::X:
+                for (const auto& tail : cNode.X()->Tails) {
+                    prefix.append(tail.Data, tail.Size);
+                    f(prefix);
+                    prefix.resize(psz);
+                }
+                break;
+            default:
+                abort();
+        }
+    }
+
+    // Calls f(const std::string&) for every valid ngram of the trie, in no particular order
+    template<typename F>
+    static void ForEachNgram(TrieRoot_t *trie, F f) {
+        std::string prefix;
+        _forEachNgram(trie->Root, prefix, f);
+    }
+
+    inline static void _growBounds(TrieRoot_t *trie, const std::string& s) {
+        if (s.empty()) { return; }
+        const uint8_t b = s[0];
+        trie->MaxBytes[b] = std::max(trie->MaxBytes[b], (uint32_t)s.size());
+        trie->MaxWords[b] = std::max(trie->MaxWords[b], (uint32_t)(1 + std::count(s.begin(), s.end(), ' ')));
+    }
+
+    // Recursively finds the longest live ngram below cNode
+    // @param bytes, words The length of the path to cNode
+    static void _subtreeBounds(NodePtr cNode, const size_t bytes, const size_t words, uint32_t *maxBytes, uint32_t *maxWords) {
+        const auto node = cNode.S(); // common fields only
+        const auto bound = [&](const size_t nbytes, const size_t nwords) {
+            *maxBytes = std::max(*maxBytes, (uint32_t)nbytes);
+            *maxWords = std::max(*maxWords, (uint32_t)nwords);
+        };
+        if (node->Valid) { bound(bytes, words); }
+        if (!node->Suffix.empty()) {
+            bound(bytes + node->Suffix.size(), words + std::count(node->Suffix.begin(), node->Suffix.end(), ' '));
+        }
+        switch(node->Type) {
+            case NodeType::S:
+                for (size_t cidx = 0; cidx<cNode.S()->DtS.Size; cidx++) {
+                    _subtreeBounds(cNode.S()->DtS.Children()[cidx], bytes+1, words + (cNode.S()->DtS.ChildrenIndex[cidx] == ' '), maxBytes, maxWords);
+                }
+                break;
+            case NodeType::M:
+                for (size_t cidx = 0; cidx<cNode.M()->DtM.Size; cidx++) {
+                    _subtreeBounds(cNode.M()->DtM.Children()[cidx], bytes+1, words + (cNode.M()->DtM.ChildrenIndex[cidx] == ' '), maxBytes, maxWords);
+                }
+                break;
+            case NodeType::W:
+                for (size_t cidx = 0; cidx<cNode.W()->DtW.Size; cidx++) {
+                    _subtreeBounds(cNode.W()->DtW.Children()[cidx], bytes+1, words + (cNode.W()->DtW.ChildrenIndex[cidx] == ' '), maxBytes, maxWords);
+                }
+                break;
+            case NodeType::L:
+                for (size_t cidx = 0; cidx<TYPE_L_MAX; cidx++) {
+                    if (!cNode.L()->DtL.Children[cidx]) { continue; }
+                    _subtreeBounds(cNode.L()->DtL.Children[cidx], bytes+1, words + (cidx == ' '), maxBytes, maxWords);
+                }
+                break;
+            case NodeType::X:
+                for (const auto& tail : cNode.X()->Tails) {
+                    bound(bytes + tail.Size, words + std::count(tail.Data, tail.Data + tail.Size, ' '));
+                }
+                break;
+            default:
+                abort();
+        }
+    }
+
+    // Whether RefreshBounds or RefreshPairs has anything to do, cheap enough for every batch
+    static bool NeedsRefresh(const TrieRoot_t *trie) {
+#ifdef USE_PAIR_FILTER
+        if (trie->Pairs.NeedsRebuild()) { return true; }
+#endif
+        return std::find(trie->StaleBounds, trie->StaleBounds + 256, true) != trie->StaleBounds + 256;
+    }
+
+    // Recomputes the bounds of the first bytes that had deletes
+    // @return the number of recomputed bytes
+    static size_t RefreshBounds(TrieRoot_t *trie) {
+        size_t refreshed = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            if (!trie->StaleBounds[b]) { continue; }
+            trie->StaleBounds[b] = false;
+            trie->MaxBytes[b] = trie->MaxWords[b] = 0;
+            if (const NodePtr child = trie->Root.L()->DtL.Children[b]) {
+                _subtreeBounds(child, 1, 1 + (b == ' '), &trie->MaxBytes[b], &trie->MaxWords[b]);
+            }
+            ++refreshed;
+        }
+        return refreshed;
+    }
+
+    // FindAll from the root, cut off at the longest live ngram starting with the first byte of s
+    inline static void FindAllBounded(const TrieRoot_t *trie, const char *s, const size_t docSize, std::vector<std::pair<size_t, uint64_t>>& results, size_t *examined) {
+        if (!docSize) {
+            FindAll(trie->Root, s, docSize, results, examined);
+            return;
+        }
+        const uint8_t b = s[0];
+        if (!trie->MaxBytes[b]) { *examined = 1; return; }
+#ifdef USE_PAIR_FILTER
+        FindAll(trie->Root, s, docSize, results, examined, trie->MaxBytes[b], trie->MaxWords[b], &trie->Pairs);
+#else
+        FindAll(trie->Root, s, docSize, results, examined, trie->MaxBytes[b], trie->MaxWords[b]);
+#endif
+    }
+
     inline static void AddNgram(TrieRoot_t *trie, const std::string& s) {
         //std::cerr << "a::" << s << std::endl;
-        cy::trie::AddString(&trie->MemoryPool, trie->Root, s);
+        cy::trie::AddString(&trie->MemoryPool, &trie->Cursor, s, trie->XDepth);
+        _growBounds(trie, s);
+#ifdef USE_PAIR_FILTER
+        trie->Pairs.InsertNgram(s.data(), s.size());
+#endif
+    }
+
+    // Rebuilds the pair filter from the live ngrams if it is too full or too stale
+    // @return if it was rebuilt
+    static bool RefreshPairs(TrieRoot_t *trie) {
+#ifdef USE_PAIR_FILTER
+        auto& pairs = trie->Pairs;
+        if (!pairs.NeedsRebuild()) { return false; }
+        const size_t live = pairs.Inserted > pairs.Removed ? pairs.Inserted - pairs.Removed : 0;
+        pairs.Reset(live * 2);
+        ForEachNgram(trie, [&](const std::string& ngram) { pairs.InsertNgram(ngram.data(), ngram.size()); });
+        return true;
+#else
+        (void)trie;
+        return false;
+#endif
+    }
+
+    // Picks the X depth from the trie the sorted ngrams make: the first depth from TYPE_X_MIN_DEPTH
+    // on where the next level has about as many nodes as this one, i.e. the paths stop branching.
+    // The nodes at depth d are the distinct prefixes of d bytes, so each ngram adds the depths
+    // past its common prefix with the previous one.
+    template<typename It>
+    static size_t _chooseXDepth(It begin, It end) {
+        constexpr size_t maxDepth = TYPE_X_DEPTH+1;
+        std::vector<int64_t> delta(maxDepth+2, 0);
+        const std::string *prev = nullptr;
+        for (; begin != end; ++begin) {
+            const std::string& s = *begin;
+            size_t lcp = 0;
+            if (prev) {
+                for (const size_t psz = std::min(prev->size(), s.size()); lcp < psz && (*prev)[lcp] == s[lcp];) { ++lcp; }
+            }
+            prev = &s;
+            const size_t last = std::min(s.size(), maxDepth);
+            if (lcp < last) {
+                delta[lcp+1]++;
+                delta[last+1]--;
+            }
+        }
+
+        std::vector<int64_t> nodes(maxDepth+1, 0);
+        for (size_t d = 1, n = 0; d <= maxDepth; ++d) { n += delta[d]; nodes[d] = n; }
+        for (size_t d = TYPE_X_MIN_DEPTH; d < maxDepth; ++d) {
+            // at most 1.1 children per node on average
+            if (nodes[d] > 0 && nodes[d+1]*10 <= nodes[d]*11) { return d; }
+        }
+        return TYPE_X_DEPTH;
+    }
+
+    // @param [begin, end) Lexicographically sorted ngrams
+    template<typename It>
+    inline static void AddSorted(TrieRoot_t *trie, It begin, It end) {
+#ifdef USE_TYPE_X
+        trie->XDepth = _chooseXDepth(begin, end);
+#endif
+#ifdef USE_PAIR_FILTER
+        size_t pairs = 0;
+        for (It it = begin; it != end; ++it) { pairs += std::count(it->begin(), it->end(), ' '); }
+        trie->Pairs.Reset(pairs * 2);
+#endif
+        for (; begin != end; ++begin) {
+            cy::trie::AddString(&trie->MemoryPool, &trie->Cursor, *begin, trie->XDepth);
+            _growBounds(trie, *begin);
+#ifdef USE_PAIR_FILTER
+            trie->Pairs.InsertNgram(begin->data(), begin->size());
+#endif
+        }
     }
 
     inline static void RemoveNgram(TrieRoot_t*trie, const std::string& s) {
         //std::cerr << "rem::" << s << std::endl;
         cy::trie::DelString(trie->Root, s);
+        if (!s.empty()) { trie->StaleBounds[(uint8_t)s[0]] = true; }
+#ifdef USE_PAIR_FILTER
+        trie->Pairs.RemoveNgram(s.data(), s.size());
+#endif
+    }
+
+    // Gives node the common fields of cNode, the suffix moved out of it
+    template<typename T>
+    static inline T* _takeFields(NodePtr cNode, T *node) {
+        const auto old = cNode.S(); // common fields only
+        node->Valid = old->Valid;
+        node->Suffix = std::move(old->Suffix);
+        return node;
+    }
+
+    // Copies the subtrie under cNode to nodes (and X node tails) of mem. The old nodes are left
+    // unreachable in their pool without their suffixes.
+    static NodePtr _copySubtrie(NodePtr cNode, MemoryPool_t *mem) {
+        switch(cNode.Type()) {
+            case NodeType::S:
+            {
+                auto node = _takeFields(cNode, mem->_newNodeS());
+                node->DtS = cNode.S()->DtS;
+                for (size_t cidx = 0; cidx<node->DtS.Size; cidx++) {
+                    node->DtS.Children()[cidx] = _copySubtrie(node->DtS.Children()[cidx], mem);
+                }
+                return node;
+            }
+            case NodeType::M:
+            {
+                auto node = _takeFields(cNode, mem->_newNodeM());
+                node->DtM = cNode.M()->DtM;
+                for (size_t cidx = 0; cidx<node->DtM.Size; cidx++) {
+                    node->DtM.Children()[cidx] = _copySubtrie(node->DtM.Children()[cidx], mem);
+                }
+                return node;
+            }
+            case NodeType::W:
+            {
+                auto node = _takeFields(cNode, mem->_newNodeW());
+                node->DtW = cNode.W()->DtW;
+                for (size_t cidx = 0; cidx<node->DtW.Size; cidx++) {
+                    node->DtW.Children()[cidx] = _copySubtrie(node->DtW.Children()[cidx], mem);
+                }
+                return node;
+            }
+            case NodeType::L:
+            {
+                NodePtr copy = _newTrieNodeL(mem);
+                auto node = _takeFields(cNode, copy.L());
+                for (size_t cidx = 0; cidx<TYPE_L_MAX; cidx++) {
+                    if (!cNode.L()->DtL.Children[cidx]) { continue; }
+                    node->DtL.Children[cidx] = _copySubtrie(cNode.L()->DtL.Children[cidx], mem);
+                }
+                return copy;
+            }
+            case NodeType::X:
+            {
+                NodePtr copy = _newTrieNodeX(mem);
+                auto node = _takeFields(cNode, copy.X());
+                node->MaxLen = cNode.X()->MaxLen;
+                for (const auto& tail : cNode.X()->Tails) {
+                    node->Tails.insert(StrView_t(mem->_newTail(tail.Data, tail.Size), tail.Size));
+                }
+                return copy;
+            }
+            default:
+                abort();
+        }
+    }
+
+    // Moves the ngrams starting with byte b (the subtrie under the root) to another trie. The
+    // subtrie is copied to the pool of to, so each trie only points into its own pool (and a
+    // trie can be freed on its own); the old nodes stay in the pool of from, which never frees
+    // nodes anyway, and still count as used in its CollectStats.
+    inline static void MoveRootChild(TrieRoot_t *from, TrieRoot_t *to, const uint8_t b) {
+        auto& child = from->Root.L()->DtL.Children[b];
+#ifdef USE_PAIR_FILTER
+        if (child) {
+            // the pairs stay in the filter of from as stale ones
+            auto movePairs = [&](const std::string& ngram) {
+                to->Pairs.InsertNgram(ngram.data(), ngram.size());
+                from->Pairs.RemoveNgram(ngram.data(), ngram.size());
+            };
+            std::string prefix(1, (char)b);
+            _forEachNgram(child, prefix, movePairs);
+        }
+#endif
+        to->Root.L()->DtL.Children[b] = child ? _copySubtrie(child, &to->MemoryPool) : nullptr;
+        child = nullptr;
+        to->MaxBytes[b] = from->MaxBytes[b];
+        to->MaxWords[b] = from->MaxWords[b];
+        to->StaleBounds[b] = from->StaleBounds[b];
+        from->MaxBytes[b] = from->MaxWords[b] = 0;
+        from->StaleBounds[b] = false;
+        // the insertion paths may go through the moved subtrie
+        for (auto trie : {from, to}) {
+            trie->Cursor.Path.resize(1);
+            trie->Cursor.Prev.clear();
+        }
     }
 
 };
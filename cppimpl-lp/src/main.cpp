@@ -1,11 +1,22 @@
 #include "include/Timer.hpp"
 #include "include/CYUtils.hpp"
 #include "include/Trie.hpp"
+#include "include/FrozenTrie.hpp"
+#include "include/NgramHash.hpp"
+#include "include/Membership.hpp"
+#include "include/ResultCache.hpp"
+#include "include/BatchWriter.hpp"
+#include "include/Tokenizer.hpp"
+#include "include/ShardBalancer.hpp"
+#include "include/BatchScheduler.hpp"
+#include "include/OpReader.hpp"
+#include "include/ShmRing.hpp"
 
 #include "include/cpp_btree/btree_map.h"
 #include "include/cpp_btree/btree_set.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstdint>
 #include <iostream>
 #include <unordered_map>
@@ -16,14 +27,39 @@
 #include <string>
 #include <algorithm>
 #include <cassert>
+#include <csignal>
 
 #include <omp.h>
 
 #define USE_OPENMP
 //#define USE_PARALLEL
+#define USE_RESULT_CACHE
+#define USE_SHARD_REBALANCING
+#define USE_ADAPTIVE_SCHEDULING
+// Build with -DCOUNT_ALLOCATIONS (make main-alloc) to report the heap allocations of the query path
+
+// The result cache is off unless the CY_RESULT_CACHE_MB environment variable gives it a budget:
+// a miss costs a copy and a hash of every document, which only pays off with repeated documents
+static size_t resultCacheBytes() {
+    const char *mb = std::getenv("CY_RESULT_CACHE_MB");
+    return mb ? (size_t)std::strtoull(mb, nullptr, 10) << 20 : 0;
+}
 
 cy::Timer_t timer;
 
+#ifdef COUNT_ALLOCATIONS
+// Every operator new of the thread bumps it, so the query path can be checked for allocations
+static thread_local size_t threadAllocs = 0;
+
+void* operator new(size_t sz) {
+    ++threadAllocs;
+    if (void *p = std::malloc(sz ? sz : 1)) { return p; }
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+#endif
+
 template<typename K, typename V> using Map = btree::btree_map<K, V>;
 template<typename K, typename V> using Set = btree::btree_set<K, V>;
 
@@ -57,39 +93,294 @@ struct Result_t {
     Result_t(const char* s, const char*e, uint64_t id) : start(s), end(e), ngramIdx(id) {}
 };
 
+// What the shards keep their ngrams in, chosen at startup (argv[2])
+//  TRIE   - a single mutable trie
+//  TIERED - the initial ngrams in a frozen trie, the updates in a small mutable trie (the delta)
+//           and a set of the deleted frozen ngrams (tombstones), merged into a new frozen trie
+//           once the delta grows
+//  HASH   - a hash table of the ngrams probed at every word end (for short ngrams)
+enum class Backend_t : uint8_t { TRIE = 0, TIERED = 1, HASH = 2 };
+static const char* BACKEND_NAMES[3] = { "trie", "tiered", "hash" };
+static Backend_t backend = Backend_t::TRIE;
+
+// Negotiated by the first line of stdin (cy::io::BINARY_PROTOCOL_LINE): the results go out as
+// offsets into the documents instead of text lines
+static bool binaryProtocol = false;
+
+// The delta only holds the updates since the last merge so its pool gets small blocks,
+// and so does the unused trie of the other backends
+constexpr size_t DELTA_POOL_BLOCK_SIZE_S = 1<<14;
+// The delta is merged after this many updates, or after 1/8th of the frozen ngrams if more
+constexpr size_t MERGE_MIN_UPDATES = 1<<14;
+
 struct NgramDB {
 
-    cy::trie::TrieRoot_t Trie;
+    cy::trie::TrieRoot_t *Trie; // all the ngrams (TRIE) or the delta (TIERED)
+
+    cy::hash::NgramHash_t Hash; // HASH: all the ngrams
+
+    // TRIE, TIERED: the live ngrams, to drop the deletes of absent ngrams without walking the trie
+    // (the hash table does that in one probe by itself). A fingerprint match is checked by _isLive.
+    cy::member::FingerprintSet_t Members;
+    size_t NoopUpdates;
+    std::vector<std::pair<size_t, uint64_t>> _liveScratch; // of the thread that updates the shard
+
+    // TIERED: the ngrams of the last merge (minus the tombstones), never in the delta too
+    cy::frozen::FrozenTrie_t Frozen;
+    btree::btree_set<uint32_t> Tombstones;
+    size_t DeltaUpdates;
+    size_t Merges;
 
     public:
 
-    NgramDB() {}
+    NgramDB() : Trie(_newTrie()), NoopUpdates(0), DeltaUpdates(0), Merges(0) {}
+    ~NgramDB() { delete Trie; }
+
+    static cy::trie::TrieRoot_t* _newTrie() {
+        return new cy::trie::TrieRoot_t(backend == Backend_t::TRIE ? cy::trie::MEMORY_POOL_BLOCK_SIZE_S : DELTA_POOL_BLOCK_SIZE_S);
+    }
 
     inline void AddNgram(const std::string& s) {
         //std::cerr << "a::" << s << std::endl;
-        cy::trie::AddNgram(&Trie, s);
+        if (backend == Backend_t::HASH) {
+            Hash.Add(s.data(), s.size());
+            return;
+        }
+        if (!Members.Insert(s.data(), s.size(), [&]() { return _isLive(s); })) {
+            NoopUpdates++;
+            return;
+        }
+        if (backend == Backend_t::TIERED) {
+            DeltaUpdates++;
+            const uint32_t nidx = Frozen.Find(s.data(), s.size());
+            if (nidx != cy::frozen::NOT_FOUND) {
+                Tombstones.erase(nidx);
+                return;
+            }
+        }
+        cy::trie::AddNgram(Trie, s);
+    }
+
+    // @param [begin, end) Lexicographically sorted ngrams
+    template<typename It>
+    inline void AddNgramsSorted(It begin, It end) {
+        if (backend != Backend_t::HASH) {
+            Members.Reserve(end - begin);
+            // nothing is indexed yet, so a fingerprint match (a duplicate or a collision) just shares its slot
+            for (It it = begin; it != end; ++it) { Members.Insert(it->data(), it->size(), []() { return false; }); }
+        }
+        if (backend == Backend_t::TIERED) {
+            Frozen.Build(begin, end);
+            return;
+        }
+        if (backend == Backend_t::HASH) {
+            for (; begin != end; ++begin) { Hash.Add(begin->data(), begin->size()); }
+            return;
+        }
+        cy::trie::AddSorted(Trie, begin, end);
     }
 
     inline void RemoveNgram(const std::string& s) {
         //std::cerr << "rem::" << s << std::endl;
-        cy::trie::RemoveNgram(&Trie, s);
+        if (backend == Backend_t::HASH) {
+            Hash.Remove(s.data(), s.size());
+            return;
+        }
+        if (!Members.Erase(s.data(), s.size(), [&]() { return _isLive(s); })) {
+            NoopUpdates++;
+            return;
+        }
+        if (backend == Backend_t::TIERED) {
+            DeltaUpdates++;
+            const uint32_t nidx = Frozen.Find(s.data(), s.size());
+            if (nidx != cy::frozen::NOT_FOUND) {
+                Tombstones.insert(nidx);
+                return;
+            }
+        }
+        cy::trie::RemoveNgram(Trie, s);
+    }
+
+    // TRIE, TIERED: whether s is a live ngram, asked from the index itself: the frozen trie minus
+    // the tombstones, or else the trie (a walk of s finds s if a result ends at its last byte)
+    inline bool _isLive(const std::string& s) {
+        if (backend == Backend_t::TIERED) {
+            const uint32_t nidx = Frozen.Find(s.data(), s.size());
+            if (nidx != cy::frozen::NOT_FOUND) { return !Tombstones.count(nidx); }
+        }
+        size_t examined = 0;
+        _liveScratch.clear();
+        cy::trie::FindAll(Trie->Root, s.data(), s.size(), _liveScratch, &examined);
+        for (const auto& ngramPos : _liveScratch) {
+            if (ngramPos.first == s.size()) { return true; }
+        }
+        return false;
+    }
+
+    // TIERED
+    inline bool NeedsMerge() const {
+        return backend == Backend_t::TIERED && DeltaUpdates >= std::max(MERGE_MIN_UPDATES, Frozen.NumNgrams / 8);
+    }
+
+    // TIERED - compiles the live ngrams into a new frozen trie and starts an empty delta
+    void Merge() {
+        std::vector<std::string> ngrams;
+        ngrams.reserve(Frozen.NumNgrams + DeltaUpdates);
+        Frozen.ForEachNgram([&](const std::string& ngram, const uint32_t nidx) {
+            if (!Tombstones.count(nidx)) { ngrams.push_back(ngram); }
+        });
+        cy::trie::ForEachNgram(Trie, [&](const std::string& ngram) { ngrams.push_back(ngram); });
+        std::sort(ngrams.begin(), ngrams.end());
+
+        Frozen.Build(ngrams.begin(), ngrams.end());
+        Tombstones.clear();
+        delete Trie;
+        Trie = _newTrie();
+        DeltaUpdates = 0;
+        Merges++;
+    }
+
+    // TRIE, HASH - hands the ngrams starting with byte b over to another shard
+    inline void MoveFirstByte(NgramDB *to, const uint8_t b) {
+        if (backend == Backend_t::HASH) {
+            Hash.MoveFirstByte(&to->Hash, b);
+            return;
+        }
+        Members.MoveFirstByte(&to->Members, b);
+        cy::trie::MoveRootChild(Trie, to->Trie, b);
     }
 
     // @param doc The part of the doc to find all matching ngrams that have doc (or part of doc) as their prefix.
-    inline void FindNgrams(const std::string& doc, size_t docStart, std::vector<Result_t>& results) {
+    // @param scratch Reused buffer of the calling thread (several threads may search a shard at once)
+    // @return The number of bytes from docStart the results depend on (see cy::trie::FindAll)
+    inline size_t FindNgrams(const std::string& doc, size_t docStart, std::vector<Result_t>& results, std::vector<std::pair<size_t, uint64_t>>& scratch) const {
         const char*docStr = doc.data();
-        const auto& ngramResults = cy::trie::FindAll(Trie.Root, doc.data()+docStart, doc.size()-docStart);
-        for (const auto& ngramPos : ngramResults) {
+        size_t examined = 0;
+        if (backend == Backend_t::HASH) {
+            scratch.clear();
+            Hash.FindAll(doc.data()+docStart, doc.size()-docStart, scratch, &examined);
+            for (const auto& ngramPos : scratch) {
+                results.emplace_back(docStr+docStart, docStr+docStart+ngramPos.first, ngramPos.second);
+            }
+            return examined;
+        }
+        if (backend == Backend_t::TIERED) {
+            scratch.clear();
+            Frozen.FindAll(doc.data()+docStart, doc.size()-docStart, scratch, &examined);
+            for (const auto& ngramPos : scratch) {
+                const uint32_t nidx = ngramPos.second;
+                if (!Tombstones.empty() && Tombstones.count(nidx)) { continue; }
+                results.emplace_back(docStr+docStart, docStr+docStart+ngramPos.first, Frozen.Id(nidx));
+            }
+        }
+        size_t trieExamined = 0;
+        scratch.clear();
+        cy::trie::FindAllBounded(Trie, doc.data()+docStart, doc.size()-docStart, scratch, &trieExamined);
+        for (const auto& ngramPos : scratch) {
             results.emplace_back(docStr+docStart, docStr+docStart+ngramPos.first, ngramPos.second);
         }
+        return std::max(examined, trieExamined);
+    }
+};
+
+// Remembers for each word (by hash) the last position of the document it started a walk at
+// and how many bytes that walk depended on. Another start of the word followed by the same
+// bytes repeats the walk with the same ngrams, and the output only keeps their first occurrence.
+struct WalkMemo_t {
+    static constexpr size_t SLOTS = 1024;
+
+    struct Slot_t {
+        uint32_t Gen;
+        uint32_t Pos;
+        uint32_t Examined;
+    };
+
+    Slot_t Slots[SLOTS];
+    uint32_t Gen; // slots of older generations are empty, so a reset is a single increment
+
+    WalkMemo_t() : Gen(1) { std::memset(Slots, 0, sizeof(Slots)); }
+
+    inline void Reset() {
+        if (unlikely(++Gen == 0)) {
+            std::memset(Slots, 0, sizeof(Slots));
+            Gen = 1;
+        }
+    }
+
+    inline Slot_t& Slot(const char *word) {
+        uint32_t h = 2166136261U;
+        for (; *word && *word != ' '; ++word) { h = (h ^ (uint8_t)*word) * 16777619U; }
+        return Slots[h & (SLOTS-1)];
+    }
+};
+
+// The ngram ids already written for the query being formatted.
+// Open addressing with generation stamps like WalkMemo_t, so clearing it is an increment and
+// the table is only reallocated when a query has more results than any query before.
+struct DedupSet_t {
+    struct Slot_t {
+        uint64_t Key;
+        uint32_t Gen;
+    };
+
+    std::vector<Slot_t> Slots;
+    uint32_t Gen;
+    uint32_t Shift; // 64 - log2(Slots.size())
+
+    DedupSet_t() : Slots(64, Slot_t{0, 0}), Gen(1), Shift(64-6) {}
+
+    // Empties the set and makes room for n keys
+    inline void Reset(const size_t n) {
+        size_t cap = Slots.size();
+        if (unlikely(n*2 > cap)) {
+            while (n*2 > cap) { cap <<= 1; Shift--; }
+            Slots.assign(cap, Slot_t{0, 0});
+            Gen = 1;
+            return;
+        }
+        if (unlikely(++Gen == 0)) {
+            std::fill(Slots.begin(), Slots.end(), Slot_t{0, 0});
+            Gen = 1;
+        }
+    }
+
+    // @return true if key was not in the set
+    inline bool Insert(const uint64_t key) {
+        const size_t mask = Slots.size()-1;
+        for (size_t i = (key * 0x9E3779B97F4A7C15ULL) >> Shift; ; i = (i+1) & mask) {
+            auto& slot = Slots[i];
+            if (slot.Gen != Gen) {
+                slot.Gen = Gen;
+                slot.Key = key;
+                return true;
+            }
+            if (slot.Key == key) { return false; }
+        }
     }
 };
 
 // Data for each thread
 struct ThreadData_t {
     NgramDB *Ngdb;
+    WalkMemo_t Memo;
+    size_t MemoSkips;
 
-    ThreadData_t() {
+    // Scratch of the query path, kept across queries and batches so that it does not allocate
+    std::vector<Result_t> Results;
+    std::vector<std::pair<size_t, uint64_t>> FindScratch;
+    DedupSet_t Visited;
+
+    // Load of the last batch for the shard balancer
+    uint64_t QueryTime;
+    uint32_t ByteWalks[256];
+#ifdef COUNT_ALLOCATIONS
+    size_t QueryAllocs;
+#endif
+
+    ThreadData_t() : MemoSkips(0), QueryTime(0), ByteWalks{} {
+#ifdef COUNT_ALLOCATIONS
+        QueryAllocs = 0;
+#endif
         Ngdb = new NgramDB();
     }
     ~ThreadData_t() {
@@ -101,17 +392,48 @@ struct GResult_t {
     std::vector<Result_t> Results;
     size_t ThreadsDone;
 
-    GResult_t() : ThreadsDone(0) {}
+    const std::string* Cached; // the output line if the result cache had it
+    uint64_t DocHash;
+    uint64_t Epoch;
+    size_t Hits; // results before dedup, for the cost estimates
+    double Cost;
+
+    GResult_t() : ThreadsDone(0), Cached(nullptr), DocHash(0), Epoch(0), Hits(0), Cost(0) {}
+
+    // Keeps the capacity of Results for the next batch
+    inline void Reset() {
+        Results.clear();
+        ThreadsDone = 0;
+        Cached = nullptr;
+        DocHash = 0;
+        Epoch = 0;
+        Hits = 0;
+        Cost = 0;
+    }
 };
 
+// The shard (thread) owning the ngrams that start with each byte, managed by WorkersContext::Balancer
+static uint8_t shardOf[256];
+
 struct WorkersContext {
     size_t NumThreads;
     std::vector<ThreadData_t> ThreadData;
 
     std::vector<GResult_t> GResults; // will have NumOfQs size (1 position for each Q in a batch)
+    std::vector<size_t> QueryOps; // the position of each Q in the batch
+    std::vector<size_t> QueryOrder; // the queries of each run between updates, the costliest first
+    std::vector<std::vector<uint32_t>> WordStarts; // the word starts of each Q (kept across batches)
+    cy::io::BatchWriter_t Writer;
+    cy::shard::Balancer_t Balancer;
+    cy::sched::Scheduler_t Scheduler;
+    cy::sched::HitDensity_t HitDensity;
+
+#ifdef USE_RESULT_CACHE
+    cy::cache::WordEpochs_t Epochs;
+    cy::cache::ResultCache_t Cache{resultCacheBytes()}; // disabled at capacity 0
+#endif
 
-    WorkersContext() {}
-    WorkersContext(const size_t nthreads) {
+    WorkersContext(const size_t nthreads) : Balancer(shardOf, nthreads), Scheduler(nthreads) {
         NumThreads = nthreads;
         ThreadData.resize(nthreads);
     }
@@ -140,6 +462,7 @@ static inline size_t deciderIdx(const char*p, const size_t nthreads) {
     return (*p % (nthreads<<1))>>1;
 }
 */
+/*
 // Single byte hash assignment
 static inline bool decider(const char*p, const size_t nthreads, const size_t pidx) {
     return (*p % nthreads) == pidx;
@@ -147,133 +470,253 @@ static inline bool decider(const char*p, const size_t nthreads, const size_t pid
 static inline size_t deciderIdx(const char*p, const size_t nthreads) {
     return *p % nthreads;
 }
+*/
+// Single byte table assignment (starts as byte % nthreads and follows the load)
+static inline bool decider(const char*p, const size_t nthreads, const size_t pidx) {
+    (void)nthreads;
+    return shardOf[(uint8_t)*p] == pidx;
+}
+static inline size_t deciderIdx(const char*p, const size_t nthreads) {
+    (void)nthreads;
+    return shardOf[(uint8_t)*p];
+}
+
+// The binary protocol answers a query with the number of its ngrams (u32) and the offset and
+// length (u32 each) of every one in the document, in the order of the text line
+void outputResultsBinary(std::string& out, const std::vector<Result_t>& results, DedupSet_t& visited, const char *doc) {
+    out.clear();
+    out.resize(sizeof(uint32_t) * (1 + 2*results.size()));
+    char *p = &out[0] + sizeof(uint32_t);
+    uint32_t count = 0;
+    if (!results.empty()) { visited.Reset(results.size()); }
+    for (const auto& ngram : results) {
+        if (visited.Insert(ngram.ngramIdx)) {
+            const uint32_t span[2] = { (uint32_t)(ngram.start - doc), (uint32_t)(ngram.end - ngram.start) };
+            std::memcpy(p, span, sizeof(span));
+            p += sizeof(span);
+            ++count;
+        }
+    }
+    std::memcpy(&out[0], &count, sizeof(count));
+    out.resize(p - out.data());
+}
 
-void outputResults(std::ostream& out, const std::vector<Result_t>& results) {
+void outputResults(std::string& out, const std::vector<Result_t>& results, DedupSet_t& visited, const char *doc) {
+    if (binaryProtocol) {
+        outputResultsBinary(out, results, visited, doc);
+        return;
+    }
+    out.clear();
     if (results.empty()) {
-        out << "-1\n";
+        out.append("-1\n");
         return;
     }
 
     // Filter results
-    UInt64Set visited;
+    visited.Reset(results.size());
 
-    std::stringstream ss;
-    ss << std::move(std::string(results[0].start, results[0].end-results[0].start));
-    //out << std::move(std::string(results[0].start, results[0].end-results[0].start));
+    out.append(results[0].start, results[0].end-results[0].start);
 
-    visited.insert(results[0].ngramIdx);
+    visited.Insert(results[0].ngramIdx);
     for (size_t i=1,sz=results.size(); i<sz; ++i) {
         const auto& ngram = results[i];
 
         //std::cerr << "ngram: " << (uint64_t)ngram.start << "-" << (uint64_t)ngram.end << std::endl;
 
-        auto it = visited.find(ngram.ngramIdx);
-        if (it == visited.end()) {
-            visited.insert(it, ngram.ngramIdx);
-            ss << "|" << std::move(std::string(ngram.start, ngram.end-ngram.start));
-            //out << "|" << std::move(std::string(ngram.start, ngram.end-ngram.start));
+        if (visited.Insert(ngram.ngramIdx)) {
+            out.push_back('|');
+            out.append(ngram.start, ngram.end-ngram.start);
         }
     }
-    ss << "\n";
-    out << ss.str();
+    out.push_back('\n');
 }
 
+constexpr size_t ALL_SHARDS = ~(size_t)0;
+
 //std::vector<Result_t> queryEvaluationWithResults(NgramDB *ngdb, const OpQuery& op) {
-std::vector<Result_t> queryEvaluationWithResults(NgramDB *ngdb, const std::string& doc) {
-    uint8_t nthreads = 1;
-    uint8_t pidx = 0;
-#ifdef USE_OPENMP
-    nthreads = omp_get_num_threads();
-    pidx = omp_get_thread_num();
-    //std::cerr << "pidx::" << pidx << " threads::" << nthreads <<std::endl;
-#endif
+// @param shard The shard whose words to evaluate, or ALL_SHARDS for the whole doc
+// @return The results in tdata's scratch, valid until its next query
+std::vector<Result_t>& queryEvaluationWithResults(ThreadData_t *tdata, WorkersContext *wctx, const std::string& doc, const std::vector<uint32_t>& wordStarts, const size_t shard) {
+    const size_t nthreads = wctx->NumThreads;
     //const auto decider = [=](const uint8_t byte){ return (byte % nthreads) == pidx; };
 
     const auto docPtr = doc.data();
     const size_t sz{doc.size()};
-    size_t start{0}, end{0};
-    std::vector<Result_t> results;
-
-    for (; start < sz; ) {
-        // find start of word
-        for (start = end; start < sz && doc[start] == ' '; ++start) {}
-        if (start >= sz) { break; }
+    auto& memo = tdata->Memo;
+    memo.Reset();
+    auto& results = tdata->Results;
+    results.clear();
 
+    for (const size_t start : wordStarts) {
         //if (decider(doc[start])) {
-        if (decider(docPtr + start, nthreads, pidx)) {
-            ngdb->FindNgrams(doc, start, results);
+        const size_t owner = deciderIdx(docPtr + start, nthreads);
+        if (shard == ALL_SHARDS || owner == shard) {
+            // a word always goes to the same shard so the memo holds across shards
+            auto& slot = memo.Slot(docPtr + start);
+            if (slot.Gen == memo.Gen) {
+                const size_t examined = slot.Examined;
+                if (slot.Pos + examined <= sz && start + examined <= sz
+                        && std::memcmp(docPtr + slot.Pos, docPtr + start, examined) == 0) {
+                    tdata->MemoSkips++;
+                    continue;
+                }
+            }
+            slot.Gen = memo.Gen;
+            slot.Pos = start;
+            slot.Examined = wctx->ThreadData[owner].Ngdb->FindNgrams(doc, start, results, tdata->FindScratch);
+            tdata->ByteWalks[(uint8_t)docPtr[start]]++;
         }
-
-        for (end = start; end < sz && doc[end] != ' '; ++end) {}
     }
 
-    return std::move(results);
+    return results;
 }
 /*
 inline void queryEvaluation(NgramDB *ngdb, const OpQuery& op) {
     outputResults(std::cout, std::move(queryEvaluationWithResults(ngdb, op)));
 }
 */
-inline void queryEvaluationWithAggregation(NgramDB *ngdb, WorkersContext *wctx, const size_t qIdx, const std::string& Doc) {
-    auto tresults = std::move(queryEvaluationWithResults(ngdb, Doc));
+// sort the results based on position in the doc
+static inline void sortResults(std::vector<Result_t>& results) {
+    std::sort(results.begin(), results.end(), [](const Result_t& l, const Result_t& r) {
+        if (l.start < r.start) { return true; }
+        if (l.start > r.start) { return false; }
+        return l.end < r.end;
+    });
+}
+
+inline void queryEvaluationWithAggregation(ThreadData_t *tdata, WorkersContext *wctx, const size_t qIdx, const std::string& Doc) {
+#ifdef COUNT_ALLOCATIONS
+    const size_t allocsBefore = threadAllocs;
+#endif
+    auto& gres = wctx->GResults[qIdx];
+    const std::vector<Result_t> *tresults = nullptr;
+    if (!gres.Cached) {
+        tresults = &queryEvaluationWithResults(tdata, wctx, Doc, wctx->WordStarts[qIdx], omp_get_thread_num());
+    }
     bool iShouldPrint = false;
-    auto& gresults = wctx->GResults[qIdx].Results;
+    auto& gresults = gres.Results;
 
     #pragma omp critical
     {
-        gresults.insert(gresults.end(), tresults.begin(), tresults.end());
+        if (tresults) { gresults.insert(gresults.end(), tresults->begin(), tresults->end()); }
         iShouldPrint = ++(wctx->GResults[qIdx].ThreadsDone) == wctx->NumThreads;
     }
 
     if (iShouldPrint) {
-        //std::cerr << "printing pidx::" << omp_get_thread_num() << " threads::" << omp_get_num_threads() <<std::endl;
-        // sort the results based on position in the doc and then print
-        std::sort(gresults.begin(), gresults.end(), [](const Result_t& l, const Result_t& r) {
-            if (l.start < r.start) { return true; }
-            if (l.start > r.start) { return false; }
-            return l.end < r.end;
-        });
-        outputResults(std::cout, gresults);
+        if (gres.Cached) {
+            wctx->Writer.SetExternal(qIdx, gres.Cached);
+        } else {
+            //std::cerr << "printing pidx::" << omp_get_thread_num() << " threads::" << omp_get_num_threads() <<std::endl;
+            sortResults(gresults);
+            gres.Hits = gresults.size();
+            outputResults(wctx->Writer.Line(qIdx), gresults, tdata->Visited, Doc.data());
+        }
+    }
+#ifdef COUNT_ALLOCATIONS
+    tdata->QueryAllocs += threadAllocs - allocsBefore;
+#endif
+}
+
+// Evaluates the whole doc against all the shards on the calling thread alone
+inline void queryEvaluationWhole(ThreadData_t *tdata, WorkersContext *wctx, const size_t qIdx, const std::string& Doc) {
+#ifdef COUNT_ALLOCATIONS
+    const size_t allocsBefore = threadAllocs;
+#endif
+    auto& gres = wctx->GResults[qIdx];
+    if (gres.Cached) {
+        wctx->Writer.SetExternal(qIdx, gres.Cached);
+    } else {
+        auto& results = queryEvaluationWithResults(tdata, wctx, Doc, wctx->WordStarts[qIdx], ALL_SHARDS);
+        sortResults(results);
+        gres.Hits = results.size();
+        outputResults(wctx->Writer.Line(qIdx), results, tdata->Visited, Doc.data());
     }
+#ifdef COUNT_ALLOCATIONS
+    tdata->QueryAllocs += threadAllocs - allocsBefore;
+#endif
+}
+
+// Set by SIGUSR1 or an 'I' line and served by the master at the next batch boundary
+volatile std::sig_atomic_t statsRequested = 0;
+static void requestStats(int) { statsRequested = 1; }
+
+// Walks every shard so it must only run while no batch is being processed
+void reportStats(WorkersContext *wctx) {
+    auto start = timer.getChrono();
+    cy::trie::TrieStats_t total;
+    for (size_t sidx = 0; sidx < wctx->NumThreads; ++sidx) {
+        cy::trie::TrieStats_t stats;
+        const auto ngdb = wctx->ThreadData[sidx].Ngdb;
+        cy::trie::CollectStats(ngdb->Trie, &stats);
+        stats.Print(std::cerr, "stats::shard" + std::to_string(sidx));
+        if (backend == Backend_t::TIERED) {
+            const auto& frozen = ngdb->Frozen;
+            std::cerr << "stats::shard" << sidx << " frozen nodes:" << frozen.Nodes.size() << " ngrams:" << frozen.NumNgrams
+                << " labelBytes:" << frozen.Labels.size() << " bytes:" << frozen.Bytes() << " tombstones:" << ngdb->Tombstones.size()
+                << " deltaUpdates:" << ngdb->DeltaUpdates << " merges:" << ngdb->Merges << "\n";
+        }
+        if (backend != Backend_t::HASH) {
+            const auto& pairs = ngdb->Trie->Pairs;
+            std::cerr << "stats::shard" << sidx << " pairs blocks:" << pairs.Blocks.size() << " inserted:" << pairs.Inserted
+                << " removed:" << pairs.Removed << " bytes:" << pairs.Bytes() << "\n";
+            std::cerr << "stats::shard" << sidx << " members ngrams:" << ngdb->Members.Count << " slots:" << ngdb->Members.Slots.size()
+                << " bytes:" << ngdb->Members.Bytes() << " noopUpdates:" << ngdb->NoopUpdates << "\n";
+        }
+        if (backend == Backend_t::HASH) {
+            const auto& hash = ngdb->Hash;
+            std::cerr << "stats::shard" << sidx << " hash ngrams:" << hash.NumNgrams << " entries:" << hash.Count << " slots:" << hash.Slots.size()
+                << " maxWords:" << hash.MaxWords << " poolBytes:" << hash.PoolBytes << " bytes:" << hash.Bytes() << " words";
+            for (size_t w = 1; w <= hash.MaxWords; ++w) { std::cerr << " " << w << ":" << hash.WordCounts[w]; }
+            std::cerr << "\n";
+        }
+        total.Merge(stats);
+    }
+    total.Print(std::cerr, "stats::total");
+    std::cerr << "stats::" << timer.getChrono(start) << std::endl;
 }
 
 uint64_t timeReading = 0;
 uint64_t tA{0}, tD{0}, tQ{0};
-bool readNextBatch(istream& in, WorkersContext *wctx, vector<Op_t>& Q) {
+template<typename Reader_t>
+bool readNextBatch(Reader_t& in, WorkersContext *wctx, vector<Op_t>& Q) {
     auto start = timer.getChrono();
     std::string line;
+    char type = '\0';
 
     size_t numOfQs = 0;
 
     for (;;) {
-        if (!std::getline(in, line)) {
-            if (!in.eof()) { std::cerr << "Error" << std::endl; }
+        if (!in.Next(type, line)) {
             timeReading += timer.getChrono(start);
             return true;
             break;
         }
 
         auto startSingle = timer.getChrono();
-        char type = line[0];
         switch (type) {
             case 'A':
-                Q.emplace_back(line.substr(2), OpType_t::ADD);
+                Q.emplace_back(std::move(line), OpType_t::ADD);
                 //ngdb->AddNgram(line.substr(2), opIdx);
                 tA += timer.getChrono(startSingle);
                 break;
             case 'D':
-                Q.emplace_back(line.substr(2), OpType_t::DEL);
+                Q.emplace_back(std::move(line), OpType_t::DEL);
                 //ngdb->RemoveNgram(line.substr(2), opIdx);
                 tD += timer.getChrono(startSingle);
                 break;
             case 'Q':
-                Q.emplace_back(line.substr(2), OpType_t::Q);
+                Q.emplace_back(std::move(line), OpType_t::Q);
                 numOfQs++;
                 //queryEvaluation(ngdb, std::move(OpQuery{line.substr(2), opIdx}));
                 tQ += timer.getChrono(startSingle);
                 break;
+            case 'I':
+                statsRequested = 1;
+                break;
             case 'F':
-                wctx->GResults.resize(0); wctx->GResults.resize(numOfQs);
+                if (wctx->GResults.size() < numOfQs) { wctx->GResults.resize(numOfQs); }
+                for (size_t qidx = 0; qidx < numOfQs; ++qidx) { wctx->GResults[qidx].Reset(); }
+                wctx->Writer.Reset(numOfQs);
                 timeReading += timer.getChrono(start);
                 return false;
                 break;
@@ -283,6 +726,188 @@ bool readNextBatch(istream& in, WorkersContext *wctx, vector<Op_t>& Q) {
     // should never come here!
     abort();
 }
+// Coalesces the updates of each run of A/D ops between two queries of the batch.
+// No query can observe the intermediate states of such a run so the last op of each
+// ngram wins and the earlier ones are dropped: an A then a D leaves the D, an A then
+// a D then an A leaves the A. The survivors are left sorted so that consecutive
+// inserts share their prefix walks in the trie.
+// @return the number of dropped updates
+size_t coalesceUpdates(std::vector<Op_t>& Q) {
+    size_t dropped = 0, out = 0;
+    for (size_t i = 0, sz = Q.size(); i < sz; ) {
+        if (Q[i].OpType == OpType_t::Q) {
+            if (out != i) { Q[out] = std::move(Q[i]); }
+            ++out; ++i;
+            continue;
+        }
+
+        size_t j = i;
+        for (; j < sz && Q[j].OpType != OpType_t::Q; ++j) {}
+        // stable so that the ops of the same ngram keep their arrival order
+        std::stable_sort(Q.begin()+i, Q.begin()+j, [](const Op_t& l, const Op_t& r) {
+            return l.Line < r.Line;
+        });
+        for (size_t k = i; k < j; ++k) {
+            // a later op on the same ngram overrides this one
+            if (k+1 < j && Q[k+1].Line == Q[k].Line) { ++dropped; continue; }
+            if (out != k) { Q[out] = std::move(Q[k]); }
+            ++out;
+        }
+        i = j;
+    }
+    Q.resize(out);
+    return dropped;
+}
+
+#ifdef USE_RESULT_CACHE
+// Walks the batch in order advancing the word epochs for every update, so that each query
+// is looked up in the cache against the exact trie state it would be evaluated on.
+void lookupCachedResults(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    size_t qidx = 0;
+    for (const auto& cop : Q) {
+        if (cop.OpType != OpType_t::Q) {
+            wctx->Epochs.Touch(cop.Line);
+            continue;
+        }
+        auto& gres = wctx->GResults[qidx++];
+        gres.DocHash = cy::cache::HashBytes(cop.Line.data(), cop.Line.size());
+        gres.Epoch = wctx->Epochs.Clock;
+        gres.Cached = wctx->Cache.Lookup(cop.Line, gres.DocHash, wctx->Epochs);
+    }
+}
+
+// Caches the lines of the queries evaluated in the last batch
+void cacheBatchResults(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    size_t qidx = 0;
+    for (const auto& cop : Q) {
+        if (cop.OpType != OpType_t::Q) { continue; }
+        auto& gres = wctx->GResults[qidx++];
+        if (!gres.Cached) {
+            wctx->Cache.Insert(cop.Line, gres.DocHash, gres.Epoch, wctx->Writer.Line(qidx-1));
+        }
+    }
+}
+#endif
+
+#ifdef USE_SHARD_REBALANCING
+// @master - feeds the last batch's load to the balancer and moves the subtries it reassigns
+// @param observe If the threads of the last batch only did the work of their own shard
+void rebalanceShards(WorkersContext *wctx, const bool observe) {
+    auto& tds = wctx->ThreadData;
+    std::vector<uint64_t> shardTime(wctx->NumThreads);
+    std::vector<const uint32_t*> byteWalks(wctx->NumThreads);
+    for (size_t sidx = 0; sidx < wctx->NumThreads; ++sidx) {
+        shardTime[sidx] = tds[sidx].QueryTime;
+        byteWalks[sidx] = tds[sidx].ByteWalks;
+    }
+    if (observe) { wctx->Balancer.Observe(shardTime, byteWalks); }
+    for (auto& tdata : tds) {
+        tdata.QueryTime = 0;
+        std::memset(tdata.ByteWalks, 0, sizeof(tdata.ByteWalks));
+    }
+    if (!observe) { return; }
+
+    std::vector<cy::shard::Move_t> moves;
+    wctx->Balancer.Plan(moves);
+    for (const auto& m : moves) {
+        tds[m.From].Ngdb->MoveFirstByte(tds[m.To].Ngdb, m.Byte);
+    }
+}
+#endif
+
+// @master - merges the deltas that grew too big, the shards in parallel
+void mergeDeltas(WorkersContext *wctx) {
+    std::vector<NgramDB*> due;
+    for (const auto& tdata : wctx->ThreadData) {
+        if (tdata.Ngdb->NeedsMerge()) { due.push_back(tdata.Ngdb); }
+    }
+    if (due.empty()) { return; }
+
+    auto start = timer.getChrono();
+    const long numDue = due.size();
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long i = 0; i < numDue; ++i) {
+        due[i]->Merge();
+    }
+    std::cerr << "merge::shards:" << numDue << " " << timer.getChrono(start) << std::endl;
+}
+
+size_t boundRefreshes = 0, pairRebuilds = 0;
+// @master - recomputes the ngram length bounds that deletes made stale and rebuilds the
+// pair filters that got too stale or full, the shards in parallel unless the batch ran inline.
+// Most batches leave nothing to refresh, and they do not enter a parallel region for it.
+// @param serial If the batch ran on the master alone (INLINE mode)
+void refreshBounds(WorkersContext *wctx, const bool serial) {
+    const long nshards = wctx->NumThreads;
+    long due = 0;
+    for (long sidx = 0; sidx < nshards; ++sidx) {
+        due += cy::trie::NeedsRefresh(wctx->ThreadData[sidx].Ngdb->Trie);
+    }
+    if (!due) { return; }
+
+    size_t refreshed = 0, rebuilt = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:refreshed,rebuilt) if(due > 1 && !serial)
+    for (long sidx = 0; sidx < nshards; ++sidx) {
+        const auto trie = wctx->ThreadData[sidx].Ngdb->Trie;
+        refreshed += cy::trie::RefreshBounds(trie);
+        rebuilt += cy::trie::RefreshPairs(trie);
+    }
+    boundRefreshes += refreshed;
+    pairRebuilds += rebuilt;
+}
+
+// @master - sizes the buffers the workers fill so that the query path does not allocate: a doc
+// of n bytes has at most n/2+1 word starts, and every slot and thread gets the most results any
+// query had so far, so a buffer only grows on a query with more results than all the earlier ones.
+void presizeQueryBuffers(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    const auto& qops = wctx->QueryOps;
+    for (size_t qidx = 0, sz = qops.size(); qidx < sz; ++qidx) {
+        wctx->WordStarts[qidx].reserve(Q[qops[qidx]].Line.size() / 2 + 1);
+    }
+
+    size_t results = 0, scratch = 0;
+    for (const auto& gres : wctx->GResults) { results = std::max(results, gres.Results.capacity()); }
+    for (const auto& tdata : wctx->ThreadData) {
+        results = std::max(results, tdata.Results.capacity());
+        scratch = std::max(scratch, tdata.FindScratch.capacity());
+    }
+    for (size_t qidx = 0, sz = qops.size(); qidx < sz; ++qidx) { wctx->GResults[qidx].Results.reserve(results); }
+    for (auto& tdata : wctx->ThreadData) {
+        tdata.Results.reserve(results);
+        tdata.FindScratch.reserve(scratch);
+        tdata.Visited.Reset(results);
+    }
+}
+
+// @master
+void indexQueries(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    auto& qops = wctx->QueryOps;
+    qops.resize(0);
+    for (size_t i = 0, sz = Q.size(); i < sz; ++i) {
+        if (Q[i].OpType == OpType_t::Q) { qops.push_back(i); }
+    }
+    if (wctx->WordStarts.size() < qops.size()) { wctx->WordStarts.resize(qops.size()); }
+    presizeQueryBuffers(wctx, Q);
+}
+
+// @workers - each document is tokenized once and shared by all the threads
+void tokenizeBatch(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    const long numOfQs = wctx->QueryOps.size();
+#ifdef COUNT_ALLOCATIONS
+    const size_t allocsBefore = threadAllocs;
+#endif
+    #pragma omp for schedule(dynamic, 4)
+    for (long qidx = 0; qidx < numOfQs; ++qidx) {
+        if (wctx->GResults[qidx].Cached) { continue; }
+        const auto& doc = Q[wctx->QueryOps[qidx]].Line;
+        cy::tok::FindWordStarts(doc.data(), doc.size(), wctx->WordStarts[qidx]);
+    }
+    // implicit barrier
+#ifdef COUNT_ALLOCATIONS
+    wctx->ThreadData[omp_get_thread_num()].QueryAllocs += threadAllocs - allocsBefore;
+#endif
+}
+
 void queryBatchEvaluationSingle(WorkersContext *wctx, const std::vector<Op_t>& Q) {
     uint8_t nthreads = 1;
     uint8_t pidx = 0;
@@ -292,7 +917,8 @@ void queryBatchEvaluationSingle(WorkersContext *wctx, const std::vector<Op_t>& Q
     //std::cerr << "pidx::" << (int)pidx << " threads::" << (int)nthreads <<std::endl;
 #endif
 
-    const auto ngdb = wctx->ThreadData[pidx].Ngdb;
+    const auto tdata = &wctx->ThreadData[pidx];
+    const auto ngdb = tdata->Ngdb;
 
     size_t qidx = 0;
 
@@ -313,14 +939,152 @@ void queryBatchEvaluationSingle(WorkersContext *wctx, const std::vector<Op_t>& Q
             tD += timer.getChrono(startSingle);
             break;
         case OpType_t::Q:
-            queryEvaluationWithAggregation(ngdb, wctx, qidx++, cop.Line);
-            tQ += timer.getChrono(startSingle);
+            queryEvaluationWithAggregation(tdata, wctx, qidx++, cop.Line);
+            {
+                const auto elapsed = timer.getChrono(startSingle);
+                tdata->QueryTime += elapsed;
+                tQ += elapsed;
+            }
             break;
         }
     }// processed all operations
 }
-void processWorkloadSingle(istream& in, WorkersContext *wctx) {
+// @master - the whole batch in order without entering a parallel region
+void batchEvaluationInline(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    const size_t nthreads = wctx->NumThreads;
+    const auto tdata = &wctx->ThreadData[0];
+
+    tokenizeBatch(wctx, Q);
+
+    size_t qidx = 0;
+    for (const auto& cop : Q) {
+        auto startSingle = timer.getChrono();
+
+        switch(cop.OpType) {
+        case OpType_t::ADD:
+            wctx->ThreadData[deciderIdx(cop.Line.data(), nthreads)].Ngdb->AddNgram(cop.Line);
+            tA += timer.getChrono(startSingle);
+            break;
+        case OpType_t::DEL:
+            wctx->ThreadData[deciderIdx(cop.Line.data(), nthreads)].Ngdb->RemoveNgram(cop.Line);
+            tD += timer.getChrono(startSingle);
+            break;
+        case OpType_t::Q:
+            queryEvaluationWhole(tdata, wctx, qidx++, cop.Line);
+            tQ += timer.getChrono(startSingle);
+            break;
+        }
+    }
+}
+
+// @workers - every thread does the updates of its shard, and the queries between two runs of
+// updates see the same ngrams so they are shared by the threads, each one against all the shards.
+void batchEvaluationQueryParallel(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    const size_t nthreads = omp_get_num_threads();
+    const size_t pidx = omp_get_thread_num();
+    const auto tdata = &wctx->ThreadData[pidx];
+    const auto ngdb = tdata->Ngdb;
+
+    size_t qidx = 0;
+    for (size_t i = 0, sz = Q.size(); i < sz; ) {
+        for (; i < sz && Q[i].OpType != OpType_t::Q; ++i) {
+            const auto& cop = Q[i];
+            if (!decider(cop.Line.data(), nthreads, pidx)) { continue; }
+            if (cop.OpType == OpType_t::ADD) {
+                ngdb->AddNgram(cop.Line);
+            } else {
+                ngdb->RemoveNgram(cop.Line);
+            }
+        }
+        size_t j = i;
+        for (; j < sz && Q[j].OpType == OpType_t::Q; ++j) {}
+
+        const long numOfQs = j - i;
+        const size_t firstQidx = qidx;
+        #pragma omp barrier
+        // in the order of planQueryOrder, so that a long query does not start last
+        #pragma omp for schedule(dynamic, 1)
+        for (long k = 0; k < numOfQs; ++k) {
+            const size_t oqidx = wctx->QueryOrder[firstQidx + k];
+            queryEvaluationWhole(tdata, wctx, oqidx, Q[wctx->QueryOps[oqidx]].Line);
+        }
+        // implicit barrier before the next updates
+
+        qidx += numOfQs;
+        i = j;
+    }
+}
+
+// @master - longest processing time first within each run of queries between updates:
+// the queries of a run are handed out in decreasing estimated cost, so the short ones fill
+// the gaps left by the long ones at the end. The output still goes to the qidx slots.
+void planQueryOrder(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    auto& order = wctx->QueryOrder;
+    const auto& qops = wctx->QueryOps;
+    const size_t numOfQs = qops.size();
+    order.resize(numOfQs);
+    for (size_t qidx = 0; qidx < numOfQs; ++qidx) {
+        auto& gres = wctx->GResults[qidx];
+        const auto& doc = Q[qops[qidx]].Line;
+        gres.Cost = gres.Cached ? 0.0 : wctx->HitDensity.Cost(doc.size());
+        order[qidx] = qidx;
+    }
+    // queries of the same run are consecutive in the batch
+    for (size_t first = 0; first < numOfQs; ) {
+        size_t last = first + 1;
+        for (; last < numOfQs && qops[last] == qops[last-1] + 1; ++last) {}
+        std::stable_sort(order.begin() + first, order.begin() + last, [wctx](const size_t l, const size_t r) {
+            return wctx->GResults[l].Cost > wctx->GResults[r].Cost;
+        });
+        first = last;
+    }
+}
+
+// @master - learns the hit density of the queries evaluated in the last batch
+void observeHitDensity(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    const auto& qops = wctx->QueryOps;
+    for (size_t qidx = 0, sz = qops.size(); qidx < sz; ++qidx) {
+        const auto& gres = wctx->GResults[qidx];
+        if (gres.Cached) { continue; }
+        wctx->HitDensity.Observe(Q[qops[qidx]].Line.size(), gres.Hits);
+    }
+}
+
+// @master
+cy::sched::BatchShape_t batchShape(WorkersContext *wctx, const std::vector<Op_t>& Q) {
+    cy::sched::BatchShape_t shape;
+    size_t qidx = 0;
+    bool inQueries = false;
+    for (const auto& cop : Q) {
+        if (cop.OpType != OpType_t::Q) {
+            shape.UpdateBytes += cop.Line.size();
+            inQueries = false;
+            continue;
+        }
+        if (!inQueries) { shape.Segments++; inQueries = true; }
+        if (wctx->GResults[qidx++].Cached) { continue; }
+        shape.QueryBytes += cop.Line.size();
+        shape.MaxQueryBytes = std::max(shape.MaxQueryBytes, cop.Line.size());
+    }
+    return shape;
+}
+
+#ifdef COUNT_ALLOCATIONS
+static size_t queryAllocs(WorkersContext *wctx) {
+    size_t allocs = 0;
+    for (const auto& tdata : wctx->ThreadData) { allocs += tdata.QueryAllocs; }
+    return allocs;
+}
+#endif
+
+template<typename Reader_t>
+void processWorkloadSingle(Reader_t& in, WorkersContext *wctx) {
     auto start = timer.getChrono();
+    size_t coalesced = 0;
+#ifdef COUNT_ALLOCATIONS
+    // the first batch sizes the scratch buffers, after that the query path should not allocate
+    size_t batches = 0, queries = 0, warmupQueries = 0, warmupAllocs = 0;
+#endif
 
     vector<Op_t> Q; Q.reserve(256);
 
@@ -333,39 +1097,179 @@ void processWorkloadSingle(istream& in, WorkersContext *wctx) {
         }
 
         if (!Q.empty()) {
-            // @workers
-            #pragma omp parallel shared(wctx, Q)
-            {
-                queryBatchEvaluationSingle(wctx, Q);
+            // @master
+            coalesced += coalesceUpdates(Q);
+            indexQueries(wctx, Q);
+#ifdef USE_RESULT_CACHE
+            if (wctx->Cache.Capacity) { lookupCachedResults(wctx, Q); }
+#endif
+
+            auto mode = cy::sched::Mode_t::SHARD;
+#ifdef USE_ADAPTIVE_SCHEDULING
+            mode = wctx->Scheduler.Choose(batchShape(wctx, Q), wctx->Balancer.Skew());
+#endif
+            wctx->Scheduler.Batches[(size_t)mode]++;
+
+            switch (mode) {
+            case cy::sched::Mode_t::INLINE:
+                batchEvaluationInline(wctx, Q);
+                break;
+            case cy::sched::Mode_t::SHARD:
+                // @workers
+                #pragma omp parallel shared(wctx, Q)
+                {
+                    tokenizeBatch(wctx, Q);
+                    queryBatchEvaluationSingle(wctx, Q);
+                }
+                break;
+            case cy::sched::Mode_t::QUERY:
+                planQueryOrder(wctx, Q);
+                // @workers
+                #pragma omp parallel shared(wctx, Q)
+                {
+                    tokenizeBatch(wctx, Q);
+                    batchEvaluationQueryParallel(wctx, Q);
+                }
+                break;
             }
 
-            // @master
+            // @master - all the lines of the batch in one go (before any cache insert evicts a cached line)
+            wctx->Writer.Flush();
+#ifdef COUNT_ALLOCATIONS
+            queries += wctx->QueryOps.size();
+            if (++batches == 1) {
+                warmupQueries = queries;
+                warmupAllocs = queryAllocs(wctx);
+            }
+#endif
+#ifdef USE_ADAPTIVE_SCHEDULING
+            observeHitDensity(wctx, Q);
+#endif
+#ifdef USE_RESULT_CACHE
+            if (wctx->Cache.Capacity) { cacheBatchResults(wctx, Q); }
+#endif
+#ifdef USE_SHARD_REBALANCING
+            // the frozen tries cannot hand over their subtries
+            if (wctx->NumThreads > 1 && backend != Backend_t::TIERED) { rebalanceShards(wctx, mode == cy::sched::Mode_t::SHARD); }
+#endif
+            if (backend == Backend_t::TIERED) { mergeDeltas(wctx); }
+            if (backend != Backend_t::HASH) { refreshBounds(wctx, mode == cy::sched::Mode_t::INLINE); }
             Q.resize(0);
         }
 
+        if (statsRequested) {
+            statsRequested = 0;
+            reportStats(wctx);
+        }
+
     }// end of outermost loop - exit program
-    std::cerr << "proc::" << timer.getChrono(start) << ":" << tA << ":" << tD << ":" << tQ << " reads:" << timeReading << std::endl;
+    reportStats(wctx);
+    size_t memoSkips = 0;
+    size_t noopUpdates = 0;
+    for (const auto& tdata : wctx->ThreadData) {
+        memoSkips += tdata.MemoSkips;
+        noopUpdates += tdata.Ngdb->NoopUpdates;
+    }
+    std::cerr << "proc::" << timer.getChrono(start) << ":" << tA << ":" << tD << ":" << tQ << " reads:" << timeReading << " coalesced:" << coalesced << " noopUpdates:" << noopUpdates << " memoSkips:" << memoSkips << " migrations:" << wctx->Balancer.Migrations << " boundRefreshes:" << boundRefreshes << " pairRebuilds:" << pairRebuilds << std::endl;
+    const auto& sched = wctx->Scheduler;
+    std::cerr << "sched::";
+    for (size_t m = 0; m < 3; ++m) { std::cerr << (m ? " " : "") << cy::sched::MODE_NAMES[m] << ":" << sched.Batches[m]; }
+    std::cerr << std::endl;
+#ifdef USE_RESULT_CACHE
+    const auto& cache = wctx->Cache;
+    std::cerr << "cache::capacity:" << cache.Capacity << " hits:" << cache.Hits << " misses:" << cache.Misses << " evictions:" << cache.Evictions << " bytes:" << cache.Bytes << std::endl;
+#endif
+#ifdef COUNT_ALLOCATIONS
+    const size_t allocs = queryAllocs(wctx);
+    const size_t steadyQueries = queries - warmupQueries;
+    std::cerr << "alloc::queries:" << queries << " allocs:" << allocs << " warmup:" << warmupAllocs
+        << " steadyPerQuery:" << (steadyQueries ? double(allocs - warmupAllocs) / steadyQueries : 0.0) << std::endl;
+    // the exit status is what make check-alloc checks
+    if (allocs != warmupAllocs) {
+        std::cerr << "alloc::error: the query path allocated after the first batch" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+#endif
 }
-static void readInitial(std::istream& in, WorkersContext *wctx) {
+// @master - measures the costs the scheduler compares
+// @param sample Text to time the query path with (the initial ngrams)
+void calibrateScheduler(WorkersContext *wctx, const std::string& sample) {
+    constexpr size_t ROUNDS = 64;
+    auto& sched = wctx->Scheduler;
+
+    volatile size_t sink = 0; // keeps the empty regions from being optimized out
+    auto start = timer.getChrono();
+    for (size_t r = 0; r < ROUNDS; ++r) {
+        #pragma omp parallel
+        {
+            if (omp_get_thread_num() == 0) { sink = r; }
+        }
+    }
+    (void)sink;
+    sched.RegionUs = double(timer.getChrono(start)) / ROUNDS;
+
+    start = timer.getChrono();
+    #pragma omp parallel
+    {
+        for (size_t r = 0; r < ROUNDS; ++r) {
+            #pragma omp barrier
+        }
+    }
+    sched.BarrierUs = std::max(0.0, (timer.getChrono(start) - sched.RegionUs) / ROUNDS);
+
+    // the sample against all the shards, like a query of the inline mode
+    const auto tdata = &wctx->ThreadData[0];
+    std::vector<uint32_t> wordStarts;
+    size_t bytes = 0, rounds = 0;
+    uint64_t elapsed = 0;
+    start = timer.getChrono();
+    while (!sample.empty() && elapsed < 2000 && rounds++ < 1000) {
+        cy::tok::FindWordStarts(sample.data(), sample.size(), wordStarts);
+        queryEvaluationWithResults(tdata, wctx, sample, wordStarts, ALL_SHARDS);
+        bytes += sample.size();
+        elapsed = timer.getChrono(start);
+    }
+    sched.ByteUs = bytes ? std::max(double(elapsed) / bytes, 1e-4) : 1e-3;
+    tdata->MemoSkips = 0;
+    std::memset(tdata->ByteWalks, 0, sizeof(tdata->ByteWalks));
+
+    std::cerr << "sched::regionUs:" << sched.RegionUs << " barrierUs:" << sched.BarrierUs << " byteNs:" << sched.ByteUs * 1000 << std::endl;
+}
+
+template<typename Reader_t>
+static void readInitial(Reader_t& in, WorkersContext *wctx) {
     auto start = timer.getChrono();
 
     const size_t nthreads = wctx->NumThreads;
+    constexpr size_t CALIBRATION_SAMPLE_BYTES = 1<<14;
+    std::string sample;
 
+    // Each shard gets its ngrams sorted so that the inserts reuse their common prefix paths.
+    std::vector<std::vector<std::string>> shards(nthreads);
     std::string line;
-    for (;;) {
-        if (!std::getline(in, line)) {
-            std::cerr << "error" << std::endl;
-            break;
-        }
-
-        if (line == "S") {
-            std::cerr << "init::" << timer.getChrono(start) << std::endl;
-            std::cout << "R" << std::endl;
-            break;
+    while (in.NextInit(line)) {
+        if (sample.size() < CALIBRATION_SAMPLE_BYTES) {
+            if (!sample.empty()) { sample.push_back(' '); }
+            sample.append(line);
         }
+        shards[deciderIdx(line.data(), nthreads)].push_back(std::move(line));
+    }
 
-        wctx->ThreadData[deciderIdx(line.data(), nthreads)].Ngdb->AddNgram(line);
+    for (size_t sidx = 0; sidx < nthreads; ++sidx) {
+        auto& ngrams = shards[sidx];
+        std::sort(ngrams.begin(), ngrams.end());
+        wctx->ThreadData[sidx].Ngdb->AddNgramsSorted(ngrams.begin(), ngrams.end());
     }
+
+#ifdef USE_TYPE_X
+    std::cerr << "init::xDepth";
+    for (const auto& tdata : wctx->ThreadData) { std::cerr << " " << tdata.Ngdb->Trie->XDepth; }
+    std::cerr << std::endl;
+#endif
+    calibrateScheduler(wctx, sample);
+
+    std::cerr << "init::" << timer.getChrono(start) << std::endl;
+    in.Ready();
 }
 
 int main(int argc, char**argv) {
@@ -373,6 +1277,18 @@ int main(int argc, char**argv) {
     if (argc>1) {
         threads = std::max(atoi(argv[1]), 1);
     }
+    if (argc>2) {
+        const auto found = std::find_if(std::begin(BACKEND_NAMES), std::end(BACKEND_NAMES), [&](const char *name) {
+            return !std::strcmp(argv[2], name);
+        });
+        if (found == std::end(BACKEND_NAMES)) {
+            std::cerr << "unknown backend " << argv[2] << std::endl;
+            return 1;
+        }
+        backend = (Backend_t)(found - std::begin(BACKEND_NAMES));
+    }
+    std::cerr << "backend::" << BACKEND_NAMES[(size_t)backend] << std::endl;
+    std::cerr << "cpu::" << cy::cpu::LEVEL_NAMES[(size_t)cy::cpu::LEVEL] << std::endl;
 
 #ifdef USE_OPENMP
     omp_set_dynamic(0);
@@ -381,6 +1297,8 @@ int main(int argc, char**argv) {
     std::cerr << "affinity::" << omp_get_proc_bind() << " threads::" << threads <<std::endl;
 #endif
 
+    std::signal(SIGUSR1, requestStats);
+
     std::ios_base::sync_with_stdio(false);
     setvbuf(stdin, NULL, _IOFBF, 1<<20);
 
@@ -388,9 +1306,44 @@ int main(int argc, char**argv) {
 
     WorkersContext wctx(threads);
 
-    readInitial(std::cin, &wctx);
-
-    processWorkloadSingle(std::cin, &wctx);
+    // argv[3] replays a recorded workload file instead of reading stdin, at full speed or with
+    // its recorded batch timing (argv[4] --timed)
+    if (argc>3) {
+        cy::io::ReplayReader_t reader;
+        if (!reader.Open(argv[3], argc>4 && !std::strcmp(argv[4], "--timed"))) {
+            std::cerr << "cannot replay " << argv[3] << std::endl;
+            return 1;
+        }
+        readInitial(reader, &wctx);
+        processWorkloadSingle(reader, &wctx);
+    } else if (std::getenv("NGRAM_SHM_FD")) {
+        // the shared memory transport of the harness, always with the binary protocol
+        cy::io::ShmChannel_t channel;
+        if (!channel.Open(atoi(std::getenv("NGRAM_SHM_FD")))) {
+            std::cerr << "cannot map the shared memory of NGRAM_SHM_FD" << std::endl;
+            return 1;
+        }
+        binaryProtocol = true;
+        std::cerr << "protocol::shm" << std::endl;
+        wctx.Writer.Shm = &channel;
+        readInitial(channel, &wctx);
+        processWorkloadSingle(channel, &wctx);
+    } else {
+        std::string first;
+        const bool hasFirst = (bool)std::getline(std::cin, first);
+        if (hasFirst && first == cy::io::BINARY_PROTOCOL_LINE) {
+            binaryProtocol = true;
+            std::cerr << "protocol::binary" << std::endl;
+            cy::io::FrameReader_t reader(std::cin);
+            readInitial(reader, &wctx);
+            processWorkloadSingle(reader, &wctx);
+        } else {
+            cy::io::StreamReader_t reader(std::cin);
+            if (hasFirst) { reader.Unread(std::move(first)); }
+            readInitial(reader, &wctx);
+            processWorkloadSingle(reader, &wctx);
+        }
+    }
 
     std::cerr << "main::" << timer.getChrono(start) << std::endl;
 }
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+// Writes <prefix>.init, <prefix>.work and <prefix>.result for the harness. The same options and seed
+// always give the same files: the random numbers come from a fixed generator and are never drawn
+// through the implementation-defined standard distributions.
+
+struct Options
+{
+	uint64_t seed = 1;
+	size_t dict = 10000;            // distinct words
+	double zipf = 1.0;              // exponent of the word frequencies
+	size_t init = 10000;            // distinct ngrams in the init file
+	std::vector<double> ngram_words = {0, 30, 40, 20, 10}; // weight of each number of words per ngram
+	size_t batches = 100;
+	size_t batch_size = 1000;       // operations per batch
+	double adds = 0.1, dels = 0.1, queries = 0.8;
+	size_t doc_min = 10, doc_max = 300; // words per document
+	double plant = 0.2;             // chance that the next words of a document are a live ngram
+	double del_hit = 0.6;           // chance that a delete picks a live ngram
+};
+
+// Print the usage instructions for the generator
+void usage()
+{
+	std::cerr << "Usage: generator [options] <output-prefix>\n"
+		<< "  --help              print this and exit\n"
+		<< "  --seed=N            random seed (1)\n"
+		<< "  --dict=N            dictionary words (10000)\n"
+		<< "  --zipf=S            Zipf exponent of the word frequencies (1.0)\n"
+		<< "  --init=N            distinct ngrams in the init file (10000)\n"
+		<< "  --ngram-words=W,..  weights of ngrams with 1, 2, ... words (30,40,20,10)\n"
+		<< "  --batches=N         batches in the workload (100)\n"
+		<< "  --batch-size=N      operations per batch (1000)\n"
+		<< "  --mix=A,D,Q         weights of adds, deletes and queries (0.1,0.1,0.8)\n"
+		<< "  --doc-words=MIN,MAX words per document (10,300)\n"
+		<< "  --plant=P           chance that the next document words are a live ngram (0.2)\n"
+		<< "  --del-hit=P         chance that a delete picks a live ngram (0.6)" << std::endl;
+}
+
+std::vector<double> parse_list(const char *s)
+{
+	std::vector<double> values;
+	for (const char *p = s; *p; )
+	{
+		char *end;
+		values.push_back(strtod(p, &end));
+		if (end == p)
+			break;
+		p = *end == ',' ? end + 1 : end;
+	}
+	return values;
+}
+
+bool parse_options(int argc, char *argv[], Options *opts, std::string *prefix)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		const char *eq = strchr(arg, '=');
+		if (strncmp(arg, "--", 2) != 0)
+		{
+			if (!prefix->empty())
+				return false;
+			*prefix = arg;
+			continue;
+		}
+		if (!eq)
+			return false; // every option takes a value, so this is not the output prefix
+		const std::string key(arg + 2, eq);
+		const char *val = eq + 1;
+		std::vector<double> list = parse_list(val);
+		if (key == "seed") opts->seed = strtoull(val, NULL, 10);
+		else if (key == "dict") opts->dict = strtoul(val, NULL, 10);
+		else if (key == "zipf") opts->zipf = strtod(val, NULL);
+		else if (key == "init") opts->init = strtoul(val, NULL, 10);
+		else if (key == "ngram-words")
+		{
+			opts->ngram_words = list;
+			opts->ngram_words.insert(opts->ngram_words.begin(), 0); // no ngram has 0 words
+		}
+		else if (key == "batches") opts->batches = strtoul(val, NULL, 10);
+		else if (key == "batch-size") opts->batch_size = strtoul(val, NULL, 10);
+		else if (key == "mix" && list.size() == 3)
+		{
+			opts->adds = list[0]; opts->dels = list[1]; opts->queries = list[2];
+		}
+		else if (key == "doc-words" && list.size() == 2)
+		{
+			opts->doc_min = list[0]; opts->doc_max = list[1];
+		}
+		else if (key == "plant") opts->plant = strtod(val, NULL);
+		else if (key == "del-hit") opts->del_hit = strtod(val, NULL);
+		else
+			return false;
+	}
+	return !prefix->empty() && opts->dict > 0 && opts->ngram_words.size() > 1 && opts->doc_min > 0 && opts->doc_min <= opts->doc_max;
+}
+
+// splitmix64, small and the same everywhere
+struct Random
+{
+	uint64_t state;
+	explicit Random(uint64_t seed) : state(seed) {}
+
+	uint64_t next()
+	{
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+	// in [0, n)
+	size_t below(size_t n) { return next() % n; }
+	// in [0, 1)
+	double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Picks indexes with the given weights by binary search over their cumulative sums
+struct Weighted
+{
+	std::vector<double> cdf;
+
+	explicit Weighted(const std::vector<double> &weights)
+	{
+		double sum = 0;
+		for (double w : weights)
+			cdf.push_back(sum += w);
+	}
+	size_t pick(Random &rng) const
+	{
+		const double x = rng.unit() * cdf.back();
+		return std::min<size_t>(std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin(), cdf.size() - 1);
+	}
+};
+
+// The live ngrams, with a random one at hand for the deletes and the planted document words
+struct LiveSet
+{
+	std::vector<std::string> ngrams;
+	std::unordered_map<std::string, size_t> index;
+
+	bool add(const std::string &n)
+	{
+		if (index.count(n))
+			return false;
+		index[n] = ngrams.size();
+		ngrams.push_back(n);
+		return true;
+	}
+	bool remove(const std::string &n)
+	{
+		auto it = index.find(n);
+		if (it == index.end())
+			return false;
+		const size_t i = it->second;
+		index.erase(it);
+		if (i + 1 != ngrams.size())
+		{
+			ngrams[i] = std::move(ngrams.back());
+			index[ngrams[i]] = i;
+		}
+		ngrams.pop_back();
+		return true;
+	}
+	bool contains(const std::string &n) const { return index.count(n) != 0; }
+};
+
+struct Generator
+{
+	const Options &opts;
+	Random rng;
+	std::vector<std::string> dict;
+	Weighted word_freq;
+	Weighted ngram_len;
+	Weighted op_mix;
+	LiveSet live;
+
+	explicit Generator(const Options &o) : opts(o), rng(o.seed), word_freq(zipf_weights(o)), ngram_len(o.ngram_words),
+		op_mix(std::vector<double>{o.adds, o.dels, o.queries})
+	{
+		std::unordered_set<std::string> seen;
+		while (dict.size() < opts.dict)
+		{
+			std::string w(2 + rng.below(9), 'a');
+			for (char &c : w)
+				c = 'a' + rng.below(26);
+			if (seen.insert(w).second)
+				dict.push_back(w);
+		}
+	}
+
+	static std::vector<double> zipf_weights(const Options &o)
+	{
+		std::vector<double> weights(o.dict);
+		for (size_t r = 0; r < o.dict; ++r)
+			weights[r] = 1.0 / pow(r + 1, o.zipf);
+		return weights;
+	}
+
+	std::string word() { return dict[word_freq.pick(rng)]; }
+
+	std::string ngram()
+	{
+		std::string n = word();
+		for (size_t words = ngram_len.pick(rng); words > 1; --words)
+		{
+			n += ' ';
+			n += word();
+		}
+		return n;
+	}
+
+	std::string document()
+	{
+		const size_t words = opts.doc_min + rng.below(opts.doc_max - opts.doc_min + 1);
+		std::string doc;
+		for (size_t w = 0; w < words; )
+		{
+			if (!doc.empty())
+				doc += ' ';
+			if (!live.ngrams.empty() && rng.unit() < opts.plant)
+			{
+				const std::string &n = live.ngrams[rng.below(live.ngrams.size())];
+				doc += n;
+				w += 1 + std::count(n.begin(), n.end(), ' ');
+			}
+			else
+			{
+				doc += word();
+				++w;
+			}
+		}
+		return doc;
+	}
+};
+
+// The live ngrams in doc by their first occurrence, shorter first at the same start (-1 if none).
+// Every word start is extended word by word up to the longest possible ngram and looked up in the set.
+std::string oracle(const LiveSet &live, const std::string &doc, size_t max_words)
+{
+	std::vector<size_t> starts;
+	for (size_t i = 0; i < doc.size(); ++i)
+		if (doc[i] != ' ' && (i == 0 || doc[i - 1] == ' '))
+			starts.push_back(i);
+
+	std::unordered_set<std::string> reported;
+	std::string result;
+	std::string candidate;
+	for (size_t s = 0; s < starts.size(); ++s)
+	{
+		for (size_t w = 0; w < max_words && s + w < starts.size(); ++w)
+		{
+			const size_t end = s + w + 1 < starts.size() ? starts[s + w + 1] - 1 : doc.size();
+			candidate.assign(doc, starts[s], end - starts[s]);
+			if (live.contains(candidate) && reported.insert(candidate).second)
+			{
+				if (!result.empty())
+					result += '|';
+				result += candidate;
+			}
+		}
+	}
+	return result.empty() ? "-1" : result;
+}
+
+int main(int argc, char *argv[])
+{
+	Options opts;
+	std::string prefix;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--help") == 0)
+		{
+			usage();
+			exit(EXIT_SUCCESS);
+		}
+	}
+	if (!parse_options(argc, argv, &opts, &prefix))
+	{
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	std::ofstream init_file(prefix + ".init");
+	std::ofstream work_file(prefix + ".work");
+	std::ofstream result_file(prefix + ".result");
+	if (!init_file || !work_file || !result_file)
+	{
+		std::cerr << "Cannot open the output files" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	Generator gen(opts);
+	const size_t max_words = opts.ngram_words.size() - 1;
+
+	// distinct ngrams, unless the dictionary is too small to have that many
+	for (size_t tries = 0; gen.live.ngrams.size() < opts.init && tries < 10 * opts.init; ++tries)
+	{
+		const std::string n = gen.ngram();
+		if (gen.live.add(n))
+			init_file << n << '\n';
+	}
+
+	size_t counts[3] = {0, 0, 0};
+	for (size_t batch = 0; batch < opts.batches; ++batch)
+	{
+		for (size_t op = 0; op < opts.batch_size; ++op)
+		{
+			const size_t kind = gen.op_mix.pick(gen.rng);
+			counts[kind]++;
+			if (kind == 0)
+			{
+				const std::string n = gen.ngram();
+				work_file << "A " << n << '\n';
+				gen.live.add(n);
+			}
+			else if (kind == 1)
+			{
+				const bool hit = !gen.live.ngrams.empty() && gen.rng.unit() < opts.del_hit;
+				const std::string n = hit ? gen.live.ngrams[gen.rng.below(gen.live.ngrams.size())] : gen.ngram();
+				work_file << "D " << n << '\n';
+				gen.live.remove(n);
+			}
+			else
+			{
+				const std::string doc = gen.document();
+				work_file << "Q " << doc << '\n';
+				result_file << oracle(gen.live, doc, max_words) << '\n';
+			}
+		}
+		work_file << "F\n";
+	}
+
+	std::cerr << "ngrams: " << gen.live.ngrams.size() << " adds: " << counts[0] << " deletes: " << counts[1] << " queries: " << counts[2] << std::endl;
+	return EXIT_SUCCESS;
+}
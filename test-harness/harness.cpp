@@ -3,21 +3,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <new>
+
+#include "replay.h"
+#include "shm_ring.h"
 
-const unsigned BATCH_SIZE = 1000;
 const unsigned long MAX_FAILED_QUERIES = 100;
+const int PIPE_SIZE = 1 << 20; // the default max for unprivileged processes (/proc/sys/fs/pipe-max-size)
+const size_t IO_CHUNK = 1 << 20;
+const char BINARY_PROTOCOL_LINE[] = "NGRAM-BINARY 1\n"; // the first line that switches the engine to the binary protocol
+const size_t SHM_RING_SIZE = 1 << 26; // bytes of each ring of --shm (the largest frame), only touched pages are allocated
+const char END_OF_INIT_FRAME[REPLAY_RECORD_HEADER] = {'S', 0, 0, 0, 0};
+
+// Bytes to send, in a loaded batch or in the mapping of a replay file
+struct Span
+{
+	const char *data;
+	size_t size;
+};
 
 // Print the usage instructions for the harness
 void usage()
 {
-	std::cerr << "Usage: harness <init-file> <workload-file> <result-file> <test-executable>" << std::endl;
+	std::cerr << "Usage: harness [--binary|--shm] <init-file> <workload-file> <result-file> <test-executable>\n"
+		<< "       harness [--shm] --replay [--timed] <replay-file> <result-file> <test-executable>\n"
+		<< "  --binary  talk the binary protocol of the engine (replay.h records in, offsets out)\n"
+		<< "  --replay  send the records of a replay file as they are, which implies --binary\n"
+		<< "  --shm     the binary protocol over shared memory rings instead of the pipes (shm_ring.h)" << std::endl;
 }
 
 // Set a file descriptor to be non-blocking
@@ -29,6 +54,34 @@ int set_nonblocking(int fd)
 	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+// Enlarge the kernel buffer of a pipe so that the harness does not limit the throughput it measures.
+// Not every kernel allows it, so a failure only leaves the default size.
+void set_pipe_size(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+#else
+	(void)fd;
+#endif
+}
+
+// Monotonic time in microseconds
+unsigned long long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The value at the given percentile of sorted values
+unsigned long long percentile(const std::vector<unsigned long long> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(idx, sorted.size() - 1)];
+}
+
 // Read a given number of bytes to the specified file descriptor
 ssize_t read_bytes(int fd, void *buffer, size_t num_bytes)
 {
@@ -69,19 +122,223 @@ ssize_t write_bytes(int fd, const void *buffer, size_t num_bytes)
 	return num_bytes;
 }
 
+// The query documents among the frames of a batch, where the results of the binary protocol point
+void find_docs(const Span &frames, std::vector<Span> &docs)
+{
+	char op;
+	const char *payload;
+	size_t size;
+	for (const char *p = frames.data, *end = p + frames.size; p && p != end; )
+	{
+		p = replay_record(p, end, &op, &payload, &size);
+		if (op == 'Q')
+		{
+			Span doc = {payload, size};
+			docs.push_back(doc);
+		}
+	}
+}
+
+// Takes the batches of a recorded workload from the mapping of its replay file: the records are the
+// frames of the binary protocol so they go to the engine as they are, and the query documents are
+// found in place. The start time of each batch goes to batch_times.
+void load_replay(const ReplayFile &replay, std::ifstream &result_file, std::vector<Span> &input_batches, std::vector<std::vector<Span> > &batch_docs,
+		std::vector<std::vector<std::string> > &result_batches, std::vector<unsigned long long> &batch_times)
+{
+	for (uint64_t b = 0; b != replay.header->num_batches; ++b)
+	{
+		const ReplayBatch &batch = replay.batches[b];
+		Span input = {replay.data + batch.offset, batch.size};
+		std::vector<Span> docs;
+		find_docs(input, docs);
+		if (docs.size() != batch.queries)
+		{
+			std::cerr << "Corrupt replay file: batch " << b << " has " << docs.size() << " queries instead of " << batch.queries << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::vector<std::string> results(batch.queries);
+		for (uint32_t q = 0; q != batch.queries; ++q)
+			std::getline(result_file, results[q]);
+
+		input_batches.push_back(input);
+		batch_docs.push_back(docs);
+		result_batches.push_back(results);
+		batch_times.push_back(batch.time_us);
+	}
+}
+
+// Turns text lines into the frames of the binary protocol: the ngrams of the init (as 'A' frames)
+// or the ops of a batch
+void to_frames(const std::string &text, bool init, std::string &frames)
+{
+	for (size_t pos = 0, nl; pos < text.size(); pos = nl + 1)
+	{
+		nl = text.find('\n', pos);
+		if (nl == std::string::npos)
+			nl = text.size();
+		const char *line = text.data() + pos;
+		const size_t size = nl - pos;
+		if (init)
+		{
+			replay_append(frames, 'A', line, size);
+			continue;
+		}
+		if (size == 0)
+			continue;
+		const size_t skip = std::min<size_t>(2, size);
+		replay_append(frames, line[0], line + skip, size - skip);
+	}
+}
+
+// Decodes a result of the binary protocol (a u32 count and a u32 offset and length into the document
+// for each ngram) into its text line
+// @return the bytes of the result, 0 if it is not complete in the avail bytes at p
+size_t decode_result(const char *p, size_t avail, const Span &doc, std::string &text)
+{
+	uint32_t count;
+	if (avail < sizeof(count))
+		return 0;
+	memcpy(&count, p, sizeof(count));
+	const size_t size = sizeof(count) + count * 2 * sizeof(uint32_t);
+	if (avail < size)
+		return 0;
+
+	text.clear();
+	for (uint32_t i = 0; i != count; ++i)
+	{
+		uint32_t span[2];
+		memcpy(span, p + sizeof(count) + i * sizeof(span), sizeof(span));
+		if (i)
+			text += '|';
+		if ((size_t)span[0] + span[1] <= doc.size)
+			text.append(doc.data + span[0], span[1]);
+		else
+			text += "<bad offset>";
+	}
+	if (count == 0)
+		text = "-1";
+	return size;
+}
+
+// Compares the complete results of the binary protocol at the start of pending with the expected
+// lines of the batch and drops them from pending
+void check_binary_results(std::string &pending, const std::vector<Span> &docs, const std::vector<std::string> &expected,
+		size_t &output_read, unsigned long &query_no, unsigned long &failure_cnt)
+{
+	size_t pos = 0;
+	std::string text;
+	while (output_read < expected.size())
+	{
+		size_t size = decode_result(pending.data() + pos, pending.size() - pos, docs[output_read], text);
+		if (size == 0)
+			break;
+		pos += size;
+		if (failure_cnt < MAX_FAILED_QUERIES && text != expected[output_read])
+		{
+			std::cerr << "Result mismatch for query " << query_no << ", expected: " << expected[output_read] << ", actual: " << text << std::endl;
+			++failure_cnt;
+		}
+		++output_read;
+		++query_no;
+	}
+	pending.erase(0, pos);
+}
+
+// The size of the frame at p
+size_t frame_size(const char *p, const char *end)
+{
+	char op;
+	const char *payload;
+	size_t size;
+	return replay_record(p, end, &op, &payload, &size) - p;
+}
+
+// Creates the shared memory of --shm and passes it to the test executable in NGRAM_SHM_FD
+ShmHeader *create_shm()
+{
+	int fd = memfd_create("ngram-shm", 0); // inherited by the test executable
+	const size_t size = SHM_DATA_OFFSET + 2 * SHM_RING_SIZE;
+	if (fd == -1 || ftruncate(fd, size) == -1)
+	{
+		perror("memfd");
+		exit(EXIT_FAILURE);
+	}
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	ShmHeader *h = new (p) ShmHeader();
+	memcpy(h->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+	h->version = SHM_VERSION;
+	h->ring_size = SHM_RING_SIZE;
+	setenv("NGRAM_SHM_FD", std::to_string(fd).c_str(), 1);
+	return h;
+}
+
+// Exits if the test executable is gone, when a wait on the shared memory timed out
+void check_child(pid_t pid)
+{
+	int status;
+	if (waitpid(pid, &status, WNOHANG) == pid)
+	{
+		std::cerr << "Test program exited before its output was complete" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	// Check for the correct number of arguments
-	if (argc != 5)
+	bool replay = false, timed = false, binary = false, shm = false;
+	int flags = 1;
+	for (; flags < argc && strncmp(argv[flags], "--", 2) == 0; ++flags)
+	{
+		if (strcmp(argv[flags], "--replay") == 0)
+			replay = true;
+		else if (strcmp(argv[flags], "--timed") == 0)
+			timed = true;
+		else if (strcmp(argv[flags], "--binary") == 0)
+			binary = true;
+		else if (strcmp(argv[flags], "--shm") == 0)
+			binary = shm = true;
+		else
+			break;
+	}
+	--flags;
+	if (argc - flags != 5 - replay || (timed && !replay))
 	{
 		usage();
 		exit(EXIT_FAILURE);
 	}
+	argv += flags - replay; // the replay file is argv[2] so the result file and the executable stay argv[3] and argv[4]
+	binary = binary || replay; // the records of a replay file are the frames of the binary protocol
 
-	std::vector<std::string> input_batches;
+	ReplayFile replay_file; // --replay sends its batches straight from the mapping
+	std::vector<std::string> input_text; // the batches of the workload file (as frames with --binary)
+	std::vector<Span> input_batches;
 	std::vector<std::vector<std::string> > result_batches;
+	std::vector<std::vector<Span> > batch_docs; // the query documents of each batch to decode the results with --binary
+	std::string init_text;
+	std::vector<unsigned long long> batch_times;
 
-	// Load the workload and result files and parse them into batches
+	if (replay)
+	{
+		std::ifstream result_file(argv[3]);
+		if (!result_file)
+		{
+			std::cerr << "Cannot open result file" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (!replay_file.open(argv[2]))
+		{
+			std::cerr << "Cannot open replay file or it is corrupt" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		load_replay(replay_file, result_file, input_batches, batch_docs, result_batches, batch_times);
+	}
+	else // Load the workload and result files and parse them into batches
 	{
 		std::ifstream work_file(argv[2]);
 		if (!work_file)
@@ -97,6 +354,8 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 		}
 
+		// A batch is the ops up to its F line, so that the latency of every batch of the workload
+		// is measured from its first byte sent to its last result read
 		bool eof = false;
 		while (!eof)
 		{
@@ -104,10 +363,10 @@ int main(int argc, char *argv[])
 			input_chunk.reserve(1000000);
 
 			std::vector<std::string> result_chunk;
-			result_chunk.reserve(BATCH_SIZE);
 
 			std::string line;
-			for (unsigned long line_no = 0; line_no != BATCH_SIZE; ++line_no)
+			bool flushed = false;
+			while (!flushed)
 			{
 				eof = !std::getline(work_file, line);
 				if (eof)
@@ -123,17 +382,83 @@ int main(int argc, char *argv[])
 
 					result_chunk.push_back(result);
 				}
+				flushed = line.length() > 0 && (line[0] == 'F' || line[0] == 'f');
 			}
 
 			if (!input_chunk.empty())
 			{
-				input_chunk += "F\n";
-				input_batches.push_back(input_chunk); // copy to avoid accumulation of unused space in each chunk
+				if (!flushed)
+					input_chunk += "F\n"; // the last ops of a workload that does not end with F
+				input_text.push_back(input_chunk); // copy to avoid accumulation of unused space in each chunk
 				result_batches.push_back(result_chunk); // copy may be avoided in C++ 11 with std::move
 			}
 		}
 	}
 
+	// With --binary the init and the batches of the workload file go out as frames, the query documents
+	// are kept to decode the results
+	if (binary && !replay)
+	{
+		std::ifstream init_file(argv[1], std::ios::binary);
+		if (!init_file)
+		{
+			std::cerr << "Cannot open init file" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::string frames;
+		init_text.assign(std::istreambuf_iterator<char>(init_file), std::istreambuf_iterator<char>());
+		to_frames(init_text, true, frames);
+		init_text.swap(frames);
+
+		for (size_t b = 0; b != input_text.size(); ++b)
+		{
+			frames.clear();
+			to_frames(input_text[b], false, frames);
+			input_text[b].swap(frames);
+		}
+	}
+	if (!replay)
+		batch_docs.resize(input_text.size());
+	for (size_t b = 0; b != input_text.size(); ++b)
+	{
+		Span input = {input_text[b].data(), input_text[b].size()};
+		input_batches.push_back(input);
+		if (binary)
+			find_docs(input, batch_docs[b]);
+	}
+
+	// The init of the binary protocol: the protocol line (the shared memory only carries frames), the
+	// 'A' frames of the ngrams and the 'S' frame
+	std::vector<Span> init_parts;
+	if (binary)
+	{
+		Span line = {BINARY_PROTOCOL_LINE, strlen(BINARY_PROTOCOL_LINE)};
+		Span ngrams = {init_text.data(), init_text.size()};
+		if (replay)
+		{
+			ngrams.data = replay_file.data + replay_file.header->init_offset;
+			ngrams.size = replay_file.header->init_size;
+		}
+		Span end = {END_OF_INIT_FRAME, sizeof(END_OF_INIT_FRAME)};
+		if (!shm)
+			init_parts.push_back(line);
+		init_parts.push_back(ngrams);
+		init_parts.push_back(end);
+	}
+	for (size_t b = 0; shm && b != input_batches.size(); ++b)
+	{
+		const char *end = input_batches[b].data + input_batches[b].size;
+		for (const char *p = input_batches[b].data; p != end; p += frame_size(p, end))
+		{
+			if (frame_size(p, end) > SHM_RING_SIZE)
+			{
+				std::cerr << "An operation does not fit in the shared memory ring" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	ShmHeader *shm_header = shm ? create_shm() : NULL;
+
 	// Create pipes for child communication
 	int stdin_pipe[2];
 	int stdout_pipe[2];
@@ -143,6 +468,8 @@ int main(int argc, char *argv[])
 		perror("pipe");
 		exit(EXIT_FAILURE);
 	}
+	set_pipe_size(stdin_pipe[1]);
+	set_pipe_size(stdout_pipe[0]);
 
 	// Start the test executable
 	pid_t pid = fork();
@@ -167,17 +494,43 @@ int main(int argc, char *argv[])
 	close(stdout_pipe[1]);
 
 	// Open the file and feed the initial graph
-	int init_file = open(argv[1], O_RDONLY);
-	if (init_file == -1)
+	std::vector<char> buffer(IO_CHUNK);
+	std::string line; // the result line being read, it may span reads (the bytes of incomplete results with --binary)
+	for (size_t i = 0; shm && i != init_parts.size(); ++i)
+	{
+		const char *end = init_parts[i].data + init_parts[i].size;
+		for (const char *p = init_parts[i].data; p != end; )
+		{
+			const size_t size = frame_size(p, end);
+			if (shm_put_frame(shm_header, p, size))
+			{
+				p += size;
+				continue;
+			}
+			shm_ring(&shm_header->engine_bell);
+			if (!shm_wait(&shm_header->client_bell, [&] { return shm_frame_fits(shm_header, size); }))
+				check_child(pid);
+		}
+	}
+	for (size_t i = 0; !shm && i != init_parts.size(); ++i)
+	{
+		if (write_bytes(stdin_pipe[1], init_parts[i].data, init_parts[i].size) < 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+	const bool init_loaded = binary;
+	int init_file = init_loaded ? -1 : open(argv[1], O_RDONLY);
+	if (!init_loaded && init_file == -1)
 	{
 		std::cerr << "Cannot open init file" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	while (1)
+	while (!init_loaded)
 	{
-		char buffer[4096];
-		ssize_t bytes = read(init_file, buffer, sizeof(buffer));
+		ssize_t bytes = read(init_file, buffer.data(), buffer.size());
 		if (bytes < 0)
 		{
 			if (errno == EINTR)
@@ -187,7 +540,7 @@ int main(int argc, char *argv[])
 		}
 		if (bytes == 0)
 			break;
-		ssize_t written = write_bytes(stdin_pipe[1], buffer, bytes);
+		ssize_t written = write_bytes(stdin_pipe[1], buffer.data(), bytes);
 		if (written < 0)
 		{
 			perror("write");
@@ -195,10 +548,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	close(init_file);
+	if (!init_loaded)
+		close(init_file);
 
-	// Signal the end of the initial graph and wait for the ready signal
-	ssize_t status_bytes = write_bytes(stdin_pipe[1], "S\n", 2);
+	// Signal the end of the initial graph (already in the frames with --binary) and wait for the ready signal
+	ssize_t status_bytes = binary ? 0 : write_bytes(stdin_pipe[1], "S\n", 2);
 	if (status_bytes < 0)
 	{
 		perror("write");
@@ -206,7 +560,20 @@ int main(int argc, char *argv[])
 	}
 
 	char status_buffer[2];
-	status_bytes = read_bytes(stdout_pipe[0], status_buffer, sizeof(status_buffer));
+	if (shm)
+	{
+		shm_ring(&shm_header->engine_bell);
+		while (line.size() < sizeof(status_buffer))
+		{
+			if (!shm_take_responses(shm_header, line) && !shm_wait(&shm_header->client_bell, [&] { return shm_has_responses(shm_header); }))
+				check_child(pid);
+		}
+		memcpy(status_buffer, line.data(), sizeof(status_buffer));
+		line.erase(0, sizeof(status_buffer));
+		status_bytes = sizeof(status_buffer);
+	}
+	else
+		status_bytes = read_bytes(stdout_pipe[0], status_buffer, sizeof(status_buffer));
 	if (status_bytes < 0)
 	{
 		perror("read");
@@ -235,31 +602,71 @@ int main(int argc, char *argv[])
 	}
 
 	// Start the stopwatch
-	struct timeval start;
-	gettimeofday(&start, NULL);
+	unsigned long long start = now_us();
 
 	unsigned long query_no = 0;
 	unsigned long failure_cnt = 0;
+	unsigned long long input_bytes = 0;
+	std::vector<unsigned long long> latencies; // per batch, from its first byte written to its last result line read
+	latencies.reserve(input_batches.size());
 
 	// Loop over all batches
 	for (unsigned long batch = 0; batch != input_batches.size() && failure_cnt < MAX_FAILED_QUERIES; ++batch)
 	{
-		std::string output; // raw output is collected here
-		output.reserve(1000000);
-
+		const Span &input = input_batches[batch];
+		const char *input_end = input.data + input.size;
+		const std::vector<std::string> &expected = result_batches[batch];
 		size_t input_ofs = 0; // byte position in the input batch
 		size_t output_read = 0; // number of lines read from the child output
 
-		while (input_ofs != input_batches[batch].length() || output_read != result_batches[batch].size())
+		// With --timed a batch is not sent before its recorded time (relative to the first batch)
+		if (timed)
+		{
+			unsigned long long due = start + (batch_times[batch] - batch_times[0]);
+			unsigned long long now = now_us();
+			if (due > now)
+				usleep(due - now);
+		}
+		unsigned long long batch_start = now_us();
+
+		// With --shm the frames go to the request ring as long as they fit and the results are checked
+		// as they come, sleeping on the doorbell only when neither can progress
+		while (shm && (input_ofs != input.size || output_read != expected.size()))
+		{
+			bool pushed = false;
+			while (input_ofs != input.size)
+			{
+				size_t size = frame_size(input.data + input_ofs, input_end);
+				if (!shm_put_frame(shm_header, input.data + input_ofs, size))
+					break;
+				input_ofs += size;
+				pushed = true;
+			}
+			if (pushed)
+				shm_ring(&shm_header->engine_bell);
+			if (shm_take_responses(shm_header, line))
+			{
+				shm_ring(&shm_header->engine_bell);
+				check_binary_results(line, batch_docs[batch], expected, output_read, query_no, failure_cnt);
+				continue;
+			}
+			if (!pushed && !shm_wait(&shm_header->client_bell, [&] {
+						return (input_ofs != input.size && shm_frame_fits(shm_header, frame_size(input.data + input_ofs, input_end)))
+							|| shm_has_responses(shm_header);
+					}))
+				check_child(pid);
+		}
+
+		while (!shm && (input_ofs != input.size || output_read != expected.size()))
 		{
 			fd_set read_fd, write_fd;
 			FD_ZERO(&read_fd);
 			FD_ZERO(&write_fd);
 
-			if (input_ofs != input_batches[batch].length())
+			if (input_ofs != input.size)
 				FD_SET(stdin_pipe[1], &write_fd);
 
-			if (output_read != result_batches[batch].size())
+			if (output_read != expected.size())
 				FD_SET(stdout_pipe[0], &read_fd);
 
 			int retval = select(std::max(stdin_pipe[1], stdout_pipe[0]) + 1, &read_fd, &write_fd, NULL, NULL);
@@ -269,11 +676,10 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 
-			// Read output from the test program
+			// Read output from the test program and compare each line as soon as it is complete
 			if (FD_ISSET(stdout_pipe[0], &read_fd))
 			{
-				char buffer[4096];
-				int bytes = read(stdout_pipe[0], buffer, sizeof(buffer));
+				ssize_t bytes = read(stdout_pipe[0], buffer.data(), buffer.size());
 				if (bytes < 0)
 				{
 					if (errno == EINTR)
@@ -281,22 +687,49 @@ int main(int argc, char *argv[])
 					perror("read");
 					exit(1);
 				}
-				// Count how many lines were returned
-				for (size_t j = 0; j != size_t(bytes); ++j)
+				if (bytes == 0)
 				{
-					if (buffer[j] == '\n')
+					std::cerr << "Incomplete batch output for batch " << batch << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				if (binary)
+				{
+					line.append(buffer.data(), bytes);
+					check_binary_results(line, batch_docs[batch], expected, output_read, query_no, failure_cnt);
+				}
+				else
+				{
+					const char *p = buffer.data();
+					const char *end = p + bytes;
+					while (p != end)
+					{
+						const char *nl = (const char *)memchr(p, '\n', end - p);
+						if (!nl)
+						{
+							line.append(p, end);
+							break;
+						}
+						line.append(p, nl);
+						p = nl + 1;
+						if (output_read < expected.size() && failure_cnt < MAX_FAILED_QUERIES && line != expected[output_read])
+						{
+							std::cerr << "Result mismatch for query " << query_no << ", expected: " << expected[output_read] << ", actual: " << line << std::endl;
+							++failure_cnt;
+						}
+						line.clear();
 						++output_read;
+						++query_no;
+					}
 				}
-				output.append(buffer, bytes);
 			}
 
 			// Feed another chunk of data from this batch to the test program
 			if (FD_ISSET(stdin_pipe[1], &write_fd))
 			{
-				int bytes = write(stdin_pipe[1], input_batches[batch].data() + input_ofs, input_batches[batch].length() - input_ofs);
+				ssize_t bytes = write(stdin_pipe[1], input.data + input_ofs, input.size - input_ofs);
 				if (bytes < 0)
 				{
-					if (errno == EINTR)
+					if (errno == EINTR || errno == EAGAIN)
 						continue;
 					perror("write");
 					exit(EXIT_FAILURE);
@@ -305,42 +738,40 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		// Parse and compare the batch result
-		std::stringstream result(output);
-                
-		for (unsigned i = 0; i != result_batches[batch].size() && failure_cnt < MAX_FAILED_QUERIES; ++i)
-		{
-			std::string val;
-                        
-			//result >> val;
-                        std::getline(result,val);
-			if (!result)
-			{
-				std::cerr << "Incomplete batch output for batch " << batch << std::endl;
-				exit(EXIT_FAILURE);
-			}
-
-			bool matched = val == result_batches[batch][i];
-			if (!matched)
-			{
-				std::cerr << "Result mismatch for query " << query_no << ", expected: " << result_batches[batch][i] << ", actual: " << val << std::endl;
-				++failure_cnt;
-			}
-                        /*if (matched)
-                        {
-                            std::cout << std::endl << val << std::endl <<  std::endl << result_batches[batch][i];
-                        }*/
-			++query_no;
-		}
+		latencies.push_back(now_us() - batch_start);
+		input_bytes += input.size;
 	}
 
-	struct timeval end;
-	gettimeofday(&end, NULL);
+	unsigned long long end = now_us();
+
+	// Let the test program see the end of its input and collect its resource usage
+	if (shm)
+	{
+		shm_header->closed.store(1);
+		shm_ring(&shm_header->engine_bell);
+	}
+	close(stdin_pipe[1]);
+	close(stdout_pipe[0]);
+	int status = 0;
+	struct rusage usage;
+	memset(&usage, 0, sizeof(usage));
+	if (wait4(pid, &status, 0, &usage) == -1)
+		perror("wait4");
 
 	if (failure_cnt == 0)
 	{
+		double elapsed_sec = (end - start) / 1000000.0;
+		std::sort(latencies.begin(), latencies.end());
+		std::cerr << "batches: " << latencies.size() << " queries: " << query_no << " bytes: " << input_bytes << std::endl;
+		std::cerr << "batch latency us p50: " << percentile(latencies, 50) << " p95: " << percentile(latencies, 95)
+			<< " p99: " << percentile(latencies, 99) << " max: " << (latencies.empty() ? 0 : latencies.back()) << std::endl;
+		std::cerr << "throughput queries/s: " << (unsigned long long)(query_no / elapsed_sec)
+			<< " bytes/s: " << (unsigned long long)(input_bytes / elapsed_sec) << std::endl;
+		std::cerr << "child peak rss kb: " << usage.ru_maxrss
+			<< " user ms: " << usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000
+			<< " sys ms: " << usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000 << std::endl;
+
 		// Output the elapsed time in milliseconds
-		double elapsed_sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
 		std::cout << (long) (elapsed_sec * 1000) << std::endl;
 		return EXIT_SUCCESS;
 	}
@@ -0,0 +1,255 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include "replay.h"
+
+const size_t IO_CHUNK = 1 << 20;
+
+// Print the usage instructions for the recorder
+void usage()
+{
+	std::cerr << "Usage: recorder <init-file> <workload-file> <replay-file>\n"
+		<< "       recorder --tee <replay-file>   (passes stdin to stdout and records it with its batch timing)" << std::endl;
+}
+
+// Monotonic time in microseconds
+unsigned long long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Writes a replay file as the records come: the header is rewritten with the final offsets
+// and the batch index appended when the recording is finished
+struct ReplayWriter
+{
+	FILE *file;
+	ReplayHeader header;
+	uint64_t pos;
+	std::string buf; // records not written yet
+	std::vector<ReplayBatch> batches;
+	ReplayBatch batch; // the batch being recorded
+	bool in_init;
+
+	ReplayWriter() : file(NULL), pos(sizeof(ReplayHeader)), in_init(true)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+		header.version = REPLAY_VERSION;
+		header.init_offset = sizeof(ReplayHeader);
+		memset(&batch, 0, sizeof(batch));
+	}
+
+	bool open(const char *path)
+	{
+		file = fopen(path, "wb");
+		return file && fwrite(&header, sizeof(header), 1, file) == 1;
+	}
+
+	void flush(bool force)
+	{
+		if (!force && buf.size() < IO_CHUNK)
+			return;
+		if (!buf.empty() && fwrite(buf.data(), buf.size(), 1, file) != 1)
+		{
+			perror("fwrite");
+			exit(EXIT_FAILURE);
+		}
+		pos += buf.size();
+		buf.clear();
+	}
+
+	void init(const char *ngram, size_t size)
+	{
+		replay_append(buf, 'A', ngram, size);
+		flush(false);
+	}
+
+	void end_init()
+	{
+		in_init = false;
+		header.init_size = pos + buf.size() - header.init_offset;
+	}
+
+	// @param time_us When the op arrived, only used for the first op of a batch
+	void op(char op, const char *payload, size_t size, unsigned long long time_us)
+	{
+		if (batch.size == 0)
+		{
+			batch.offset = pos + buf.size();
+			batch.time_us = time_us;
+		}
+		const size_t before = buf.size();
+		replay_append(buf, op, payload, size);
+		batch.size += buf.size() - before;
+		if (op == 'F')
+		{
+			batches.push_back(batch);
+			memset(&batch, 0, sizeof(batch));
+		}
+		else
+		{
+			batch.ops++;
+			batch.queries += op == 'Q';
+		}
+		flush(false);
+	}
+
+	void finish()
+	{
+		if (in_init)
+			end_init();
+		if (batch.size)
+			op('F', "", 0, 0);
+		// the index is read in place so it starts 8 byte aligned
+		buf.append((8 - (pos + buf.size()) % 8) % 8, '\0');
+		flush(true);
+		header.num_batches = batches.size();
+		header.index_offset = pos;
+		if ((!batches.empty() && fwrite(batches.data(), sizeof(ReplayBatch), batches.size(), file) != batches.size())
+				|| fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1 || fclose(file) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		file = NULL;
+	}
+
+	// Records a line of the text protocol
+	// @param time_us When it arrived relative to the end of the init
+	void line(const char *l, size_t size, unsigned long long time_us)
+	{
+		if (in_init)
+		{
+			if (size == 1 && l[0] == 'S')
+				end_init();
+			else
+				init(l, size);
+			return;
+		}
+		if (size == 0)
+			return;
+		switch (l[0])
+		{
+		case 'A': case 'D': case 'Q':
+			op(l[0], l + std::min<size_t>(2, size), size - std::min<size_t>(2, size), time_us);
+			break;
+		case 'F':
+			op('F', "", 0, time_us);
+			break;
+		default:
+			break; // not part of the workload (e.g. the stats request)
+		}
+	}
+};
+
+// Records the init and workload files as they are, without timing
+void record_files(ReplayWriter &writer, const char *init_path, const char *work_path)
+{
+	std::ifstream init_file(init_path);
+	std::ifstream work_file(work_path);
+	if (!init_file || !work_file)
+	{
+		std::cerr << "Cannot open the init or workload file" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string line;
+	while (std::getline(init_file, line))
+		writer.line(line.data(), line.size(), 0);
+	writer.end_init();
+	while (std::getline(work_file, line))
+		writer.line(line.data(), line.size(), 0);
+}
+
+// Copies stdin to stdout and records the lines with the time each batch started to arrive
+void record_tee(ReplayWriter &writer)
+{
+	std::vector<char> buffer(IO_CHUNK);
+	std::string partial;
+	unsigned long long init_end = 0;
+	while (1)
+	{
+		ssize_t bytes = read(STDIN_FILENO, buffer.data(), buffer.size());
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		if (bytes == 0)
+			break;
+		for (const char *p = buffer.data(), *end = p + bytes; p != end; )
+		{
+			ssize_t written = write(STDOUT_FILENO, p, end - p);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+			p += written;
+		}
+
+		const unsigned long long now = now_us();
+		const char *p = buffer.data();
+		const char *end = p + bytes;
+		while (p != end)
+		{
+			const char *nl = (const char *)memchr(p, '\n', end - p);
+			if (!nl)
+			{
+				partial.append(p, end);
+				break;
+			}
+			partial.append(p, nl);
+			p = nl + 1;
+			const bool was_init = writer.in_init;
+			writer.line(partial.data(), partial.size(), was_init ? 0 : now - init_end);
+			if (was_init && !writer.in_init)
+				init_end = now;
+			partial.clear();
+		}
+	}
+	if (!partial.empty())
+		writer.line(partial.data(), partial.size(), now_us() - init_end);
+}
+
+int main(int argc, char *argv[])
+{
+	const bool tee = argc == 3 && strcmp(argv[1], "--tee") == 0;
+	if (!tee && argc != 4)
+	{
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	ReplayWriter writer;
+	const char *out_path = tee ? argv[2] : argv[3];
+	if (!writer.open(out_path))
+	{
+		std::cerr << "Cannot open replay file " << out_path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (tee)
+		record_tee(writer);
+	else
+		record_files(writer, argv[1], argv[2]);
+	writer.finish();
+
+	std::cerr << "batches: " << writer.header.num_batches << " bytes: " << writer.header.index_offset << std::endl;
+	return EXIT_SUCCESS;
+}
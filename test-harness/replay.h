@@ -0,0 +1,154 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+
+// The binary replay format of a recorded workload (written by recorder, read by harness --replay
+// and by engines that replay it themselves). All integers are little endian.
+//
+//   header | init records | batch records ... | batch index
+//
+// A record is the op byte ('A', 'D', 'Q', 'F', or 'A' for every init ngram), a 4 byte payload length
+// and the payload (the line without the op and its space). Every batch ends with its 'F' record.
+// The index has one entry per batch so a reader can jump to any batch or replay the recorded timing.
+// The binary protocol of the engine (harness --binary) frames its input with the same records.
+
+const char REPLAY_MAGIC[8] = {'N', 'G', 'R', 'E', 'P', 'L', 'A', 'Y'};
+const uint32_t REPLAY_VERSION = 1;
+const size_t REPLAY_RECORD_HEADER = 5;
+
+struct ReplayHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;        // none defined yet
+	uint64_t init_offset;  // the init records
+	uint64_t init_size;
+	uint64_t num_batches;
+	uint64_t index_offset; // num_batches ReplayBatch entries
+};
+
+struct ReplayBatch
+{
+	uint64_t offset;  // the first record of the batch
+	uint64_t size;    // the bytes of its records, the 'F' record included
+	uint64_t time_us; // when the batch was recorded, since the end of the init (0 if not recorded live)
+	uint32_t ops;     // A, D and Q records
+	uint32_t queries;
+};
+
+// Appends a record to buf
+inline void replay_append(std::string &buf, char op, const char *payload, size_t size)
+{
+	const uint32_t len = size;
+	buf.push_back(op);
+	buf.append((const char *)&len, sizeof(len));
+	buf.append(payload, size);
+}
+
+// Reads the record at p, which must end by end
+// @return the record after it, NULL (and an empty record) if it runs past end
+inline const char *replay_record(const char *p, const char *end, char *op, const char **payload, size_t *size)
+{
+	*op = '\0';
+	*payload = p;
+	*size = 0;
+	if ((size_t)(end - p) < REPLAY_RECORD_HEADER)
+		return NULL;
+	uint32_t len;
+	memcpy(&len, p + 1, sizeof(len));
+	if (len > (size_t)(end - p) - REPLAY_RECORD_HEADER)
+		return NULL;
+	*op = p[0];
+	*payload = p + REPLAY_RECORD_HEADER;
+	*size = len;
+	return p + REPLAY_RECORD_HEADER + len;
+}
+
+// Whether [p, end) is made of whole records
+inline bool replay_records_valid(const char *p, const char *end)
+{
+	char op;
+	const char *payload;
+	size_t size;
+	while (p != end)
+	{
+		p = replay_record(p, end, &op, &payload, &size);
+		if (!p)
+			return false;
+	}
+	return true;
+}
+
+// Whether the size bytes at offset start before the end of a file of file_size bytes and fit in it
+// (checked without adding them, so that no offset can overflow past the check)
+inline bool replay_range_valid(uint64_t offset, uint64_t size, size_t file_size)
+{
+	return offset < file_size && size <= file_size - offset;
+}
+
+// A replay file mapped in memory
+struct ReplayFile
+{
+	const char *data;
+	size_t size;
+	const ReplayHeader *header;
+	const ReplayBatch *batches;
+
+	ReplayFile() : data(NULL), size(0), header(NULL), batches(NULL) {}
+	~ReplayFile()
+	{
+		if (data)
+			munmap((void *)data, size);
+	}
+
+	// @return false if the file cannot be mapped, is not a replay file or has an offset or a record
+	// out of its bounds
+	bool open(const char *path)
+	{
+		int fd = ::open(path, O_RDONLY);
+		if (fd == -1)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ReplayHeader))
+		{
+			close(fd);
+			return false;
+		}
+		size = st.st_size;
+		void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		data = (const char *)p;
+		madvise(p, size, MADV_SEQUENTIAL);
+
+		header = (const ReplayHeader *)data;
+		if (memcmp(header->magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) != 0 || header->version != REPLAY_VERSION
+				|| !replay_range_valid(header->init_offset, header->init_size, size)
+				|| !replay_records_valid(data + header->init_offset, data + header->init_offset + header->init_size)
+				|| header->index_offset > size
+				|| header->num_batches > (size - header->index_offset) / sizeof(ReplayBatch))
+			return false;
+		batches = (const ReplayBatch *)(data + header->index_offset);
+
+		// every record is checked here so that a corrupt file is rejected before anything is replayed
+		for (uint64_t b = 0; b != header->num_batches; ++b)
+		{
+			const ReplayBatch &batch = batches[b];
+			if (!replay_range_valid(batch.offset, batch.size, size)
+					|| !replay_records_valid(data + batch.offset, data + batch.offset + batch.size))
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <atomic>
+#include <string>
+
+// The shared memory transport between the harness (the client) and the engine (harness --shm).
+// The client creates a memfd with the header and two rings, and passes its descriptor to the engine
+// in the NGRAM_SHM_FD environment variable:
+//
+//   header | request ring (ring_size bytes) | response ring (ring_size bytes)
+//
+// The requests are the frames of the binary protocol (replay.h records). A frame never wraps around
+// the end of the request ring, so the engine reads it in one piece: when it does not fit, the client
+// writes a pad frame (op 0) up to the end, or skips the end if it is shorter than a frame header.
+// The responses are the bytes the engine would write to its stdout in the binary protocol ("R\n"
+// included) and may wrap. head and tail count the bytes written and released since the start.
+//
+// Each side has a doorbell, a futex word the other side bumps after it published or released bytes.
+// A side only sleeps on its doorbell after it announced it in waiting, so the other side only makes
+// the wake syscall when somebody sleeps.
+
+const char SHM_MAGIC[8] = {'N', 'G', 'S', 'H', 'M', 'R', 'N', 'G'};
+const uint32_t SHM_VERSION = 1;
+const size_t SHM_DATA_OFFSET = 4096; // the request ring, the response ring follows
+const size_t SHM_FRAME_HEADER = 5;   // op byte and u32 payload length
+const int SHM_SPINS = 4096;          // polls before sleeping on the doorbell
+const long SHM_WAIT_NS = 100000000;  // the longest sleep, to notice a peer that died
+
+struct ShmBell
+{
+	alignas(64) std::atomic<uint32_t> seq;
+	std::atomic<uint32_t> waiting;
+};
+
+struct ShmRing
+{
+	alignas(64) std::atomic<uint64_t> head; // written by the producer
+	alignas(64) std::atomic<uint64_t> tail; // released by the consumer
+};
+
+struct ShmHeader
+{
+	char magic[8];
+	uint32_t version;
+	std::atomic<uint32_t> closed; // the client sends no more requests
+	uint64_t ring_size;           // a power of 2
+	ShmBell engine_bell;          // rung by the client
+	ShmBell client_bell;          // rung by the engine
+	ShmRing requests;
+	ShmRing responses;
+};
+
+inline char *shm_requests(ShmHeader *h) { return (char *)h + SHM_DATA_OFFSET; }
+inline char *shm_responses(ShmHeader *h) { return (char *)h + SHM_DATA_OFFSET + h->ring_size; }
+
+// Wakes the side sleeping on the bell, if any
+inline void shm_ring(ShmBell *bell)
+{
+	bell->seq.fetch_add(1);
+	if (bell->waiting.load())
+		syscall(SYS_futex, &bell->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Waits on the bell until ready() holds or SHM_WAIT_NS passed
+// @return ready()
+template <typename Ready>
+bool shm_wait(ShmBell *bell, Ready ready)
+{
+	for (int i = 0; i != SHM_SPINS; ++i)
+	{
+		if (ready())
+			return true;
+		__builtin_ia32_pause();
+	}
+	const uint32_t seq = bell->seq.load();
+	bell->waiting.store(1);
+	if (!ready())
+	{
+		struct timespec timeout = {0, SHM_WAIT_NS};
+		syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+	}
+	bell->waiting.store(0);
+	return ready();
+}
+
+// Whether a frame of the given size fits in the request ring now
+inline bool shm_frame_fits(ShmHeader *h, size_t size)
+{
+	ShmRing &r = h->requests;
+	const uint64_t head = r.head.load(std::memory_order_relaxed);
+	const size_t to_end = h->ring_size - (head & (h->ring_size - 1));
+	return size + (size > to_end ? to_end : 0) <= h->ring_size - (head - r.tail.load(std::memory_order_acquire));
+}
+
+// Copies a request frame to the request ring without wrapping it, and publishes it
+// @return false if there is no room for it yet
+inline bool shm_put_frame(ShmHeader *h, const char *frame, size_t size)
+{
+	if (!shm_frame_fits(h, size))
+		return false;
+	ShmRing &r = h->requests;
+	uint64_t head = r.head.load(std::memory_order_relaxed);
+	size_t pos = head & (h->ring_size - 1);
+	const size_t to_end = h->ring_size - pos;
+
+	char *data = shm_requests(h);
+	if (size > to_end)
+	{
+		if (to_end >= SHM_FRAME_HEADER)
+		{
+			const uint32_t pad = to_end - SHM_FRAME_HEADER;
+			data[pos] = '\0';
+			memcpy(data + pos + 1, &pad, sizeof(pad));
+		}
+		head += to_end;
+		pos = 0;
+	}
+	memcpy(data + pos, frame, size);
+	r.head.store(head + size, std::memory_order_release);
+	return true;
+}
+
+// Appends the published responses to out (at most up to the end of the ring) and releases them
+// @return the bytes appended
+inline size_t shm_take_responses(ShmHeader *h, std::string &out)
+{
+	ShmRing &r = h->responses;
+	const uint64_t tail = r.tail.load(std::memory_order_relaxed);
+	const uint64_t avail = r.head.load(std::memory_order_acquire) - tail;
+	const size_t pos = tail & (h->ring_size - 1);
+	const size_t size = avail < h->ring_size - pos ? avail : h->ring_size - pos;
+	out.append(shm_responses(h) + pos, size);
+	r.tail.store(tail + size, std::memory_order_release);
+	return size;
+}
+
+inline bool shm_has_responses(ShmHeader *h)
+{
+	return h->responses.head.load(std::memory_order_acquire) != h->responses.tail.load(std::memory_order_relaxed);
+}
+
+#endif